@@ -0,0 +1,556 @@
+#ifndef EXTENDIBLE_HASH_BUFFERPOOL_HPP
+#define EXTENDIBLE_HASH_BUFFERPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "DiskFile.hpp"
+
+/*
+ * Fixed-size pool of in-memory copies of fixed-length pages stored in a DiskFile.
+ * Pages are identified by their physical position in the file (page_ref).
+ * Frames are replaced using the CLOCK algorithm, and dirty pages are only written back on eviction or flush.
+ * A pinned page is never evicted, so references returned by `pin` remain valid until the matching `unpin`.
+ * Pages modified while the pool is holding (see `hold_modified_pages`) are not evicted either until they are released,
+ * so the changes of an operation that is not logged yet never reach the file.
+ * Frames hold whole blocks of the file (see `set_block_size`), of a single page by default: a block of several pages is read and written at once
+ * (padded with zeros), so pages smaller than an O_DIRECT block share it without writing a page ever reading the rest of its block first.
+ * `File` is the storage backend of the pages (DiskFile, MemoryFile or MappedFile).
+ * The pool may be used by several threads: its bookkeeping, and every read and write of its pages, are serialized by a latch,
+ * except the batches read by `prefetch`, so that several threads prefetching pages keep their reads in flight at the same time,
+ * and the resident pages read by `read_resident`, which neither takes the latch nor pins them (a version of every frame tells if it was reused meanwhile).
+ * The contents of a pinned page are not protected by the pool (see the bucket latches of ExtendibleHashFile).
+ */
+template<typename PageType, typename File = DiskFile>
+class BufferPool {
+    struct Frame {
+        std::vector<PageType> pages;         // < In-memory copy of the pages of the block
+        std::atomic<long> block_ref{-1};     // < Position of the block in the file (-1 if the frame is free)
+        std::atomic<std::size_t> version{0}; // < Odd while the frame is given to another block and the block is read (see `read_resident`)
+        std::size_t pin_count = 0;           // < Number of users currently holding a page of the block
+        bool dirty = false;                  // < Is `true` if a page of the block has been modified since it was read
+        std::atomic<bool> referenced{false}; // < CLOCK reference bit (second chance), also set by `read_resident` without the latch
+        bool held = false;                   // < Is `true` if a page of the block was modified by an operation that is not logged yet
+        bool loading = false;                // < Is `true` while the block is being read by `prefetch`
+    };
+
+    File &file;                                      // < File the pages belong to
+    std::size_t page_capacity;                       // < Number of pages the frames may hold in total
+    std::size_t min_frames;                          // < Number of frames always allocated
+    std::vector<Frame> frames;                       // < Fixed set of frames (only reallocated by `set_block_size`)
+    std::unordered_map<long, std::size_t> page_table;// < Maps a block_ref to the frame holding it
+    std::vector<std::atomic<std::size_t>> resident;  // < Frame (plus 1, 0 if none) of a resident block, by block_ref, read without the latch (see `find_resident`)
+    std::size_t clock_hand = 0;                      // < Next frame inspected by the CLOCK algorithm
+    bool holding = false;                            // < Is `true` while modified pages are being held
+    std::vector<long> held_pages;                    // < Pages held since `hold_modified_pages`
+    std::function<void()> before_write_back;         // < Called before dirty pages are written to the file
+    std::size_t loading_blocks = 0;                  // < Blocks being read by `prefetch`
+    std::size_t block_size = sizeof(PageType);       // < Bytes of the file taken by every block (see `set_block_size`)
+    std::size_t block_pages = 1;                     // < Pages of every block
+    std::vector<char> padding;                       // < Zeros written after the pages of every block, up to `block_size`
+    mutable std::mutex latch;                        // < Serializes the accesses to the pool
+    std::condition_variable loaded;                  // < Signals the end of the batches read by `prefetch`
+
+    /*
+     * Returns the position of the block holding the page at position page_ref.
+     */
+    long block_of(long page_ref) const {
+        if (block_pages == 1) {
+            return page_ref;
+        }
+        if (page_ref % (long) block_size % (long) sizeof(PageType) != 0) {
+            throw std::runtime_error("Cannot access a page that is not aligned to the blocks of the file.");
+        }
+        return page_ref - page_ref % (long) block_size;
+    }
+
+    PageType &page_of(Frame &frame, long page_ref) {
+        return frame.pages[(page_ref - frame.block_ref.load(std::memory_order_relaxed)) / (long) sizeof(PageType)];
+    }
+
+    std::atomic<std::size_t> &resident_slot(long block_ref) {
+        return resident[(std::size_t) (block_ref / (long) block_size) & (resident.size() - 1)];
+    }
+
+    /*
+     * Finds the frame holding the block at position block_ref without taking the latch, or nullptr.
+     * Blocks whose slot of `resident` was taken by another block are not found (they are found by `find_block`, under the latch).
+     * The frame found may be given to another block at any moment: its version tells if it was (see `read_resident`).
+     */
+    Frame *find_resident(long block_ref) {
+        std::size_t slot = resident_slot(block_ref).load(std::memory_order_acquire);
+        if (slot == 0 || frames[slot - 1].block_ref.load(std::memory_order_relaxed) != block_ref) {
+            return nullptr;
+        }
+        return &frames[slot - 1];
+    }
+
+    /*
+     * Marks the start and the end of a change of the block held by a frame (its version is odd meanwhile).
+     * Changes are made under the latch, except the end of the batches read by `prefetch`.
+     */
+    static void begin_change(Frame &frame) {
+        frame.version.store(frame.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void end_change(Frame &frame) {
+        frame.version.store(frame.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*
+     * Completes a block read with `bytes` bytes: the pages past the end of the file are default-initialized.
+     * Returns `false` if the block ends before byte `needed` (e.g. before the end of the page that was requested).
+     */
+    bool finish_read(Frame &frame, std::size_t bytes, std::size_t needed) {
+        for (std::size_t i = bytes / sizeof(PageType); i < block_pages; ++i) {
+            frame.pages[i] = PageType{};
+        }
+        return bytes >= needed;
+    }
+
+    void write_back(Frame &frame) {
+        if (before_write_back) {
+            before_write_back();
+        }
+        iovec vectors[2] = {{frame.pages.data(), block_pages * sizeof(PageType)}, {padding.data(), padding.size()}};
+        file.write_vectored(vectors, padding.empty() ? 1 : 2, frame.block_ref);
+        frame.dirty = false;
+    }
+
+    void hold(Frame &frame, long page_ref) {
+        if (holding) {
+            frame.held = true;
+            if (std::find(held_pages.begin(), held_pages.end(), page_ref) == held_pages.end()) {
+                held_pages.push_back(page_ref);
+            }
+        }
+    }
+
+    /*
+     * Runs the CLOCK algorithm until an unpinned frame without its reference bit set is found.
+     * Throws an exception if every frame is pinned.
+     */
+    std::size_t find_victim() {
+        for (std::size_t i = 0; i < 2 * frames.size(); ++i) {
+            std::size_t candidate = clock_hand;
+            clock_hand = (clock_hand + 1) % frames.size();
+            Frame &frame = frames[candidate];
+            if (frame.pin_count > 0 || frame.held) {
+                continue;
+            }
+            if (frame.referenced.load(std::memory_order_relaxed)) {
+                frame.referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            return candidate;
+        }
+        throw std::runtime_error("Buffer pool exhausted: every page is pinned or held.");
+    }
+
+    /*
+     * Evicts a victim (writing it back if dirty) and assigns its frame to the given block, already pinned.
+     * The frame is changing until its block is read (see `end_change`).
+     */
+    std::size_t acquire_frame(long block_ref) {
+        std::size_t frame_index = find_victim();
+        Frame &frame = frames[frame_index];
+        if (frame.block_ref != -1 && frame.dirty) {
+            write_back(frame);
+        }
+        begin_change(frame);
+        unlist_frame(frame_index);
+        frame.block_ref = block_ref;
+        frame.pin_count = 1;
+        frame.dirty = false;
+        frame.referenced = true;
+        page_table[block_ref] = frame_index;
+        resident_slot(block_ref).store(frame_index + 1, std::memory_order_release);
+        return frame_index;
+    }
+
+    /*
+     * Removes the block held by a frame from the tables (the frame must be changing).
+     */
+    void unlist_frame(std::size_t frame_index) {
+        long block_ref = frames[frame_index].block_ref;
+        if (block_ref == -1) {
+            return;
+        }
+        page_table.erase(block_ref);
+        if (resident_slot(block_ref).load(std::memory_order_relaxed) == frame_index + 1) {
+            resident_slot(block_ref).store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /*
+     * Finds the frame holding the block at position block_ref, waiting until it is read if `prefetch` is reading it.
+     */
+    std::unordered_map<long, std::size_t>::iterator find_block(std::unique_lock<std::mutex> &lock, long block_ref) {
+        auto it = page_table.find(block_ref);
+        while (it != page_table.end() && frames[it->second].loading) {
+            loaded.wait(lock);
+            it = page_table.find(block_ref);
+        }
+        return it;
+    }
+
+    void release_frame(std::size_t frame_index) {
+        Frame &frame = frames[frame_index];
+        bool changing = frame.version.load(std::memory_order_relaxed) % 2 != 0;
+        if (!changing) {
+            begin_change(frame);
+        }
+        unlist_frame(frame_index);
+        frame.block_ref = -1;
+        frame.pin_count = 0;
+        frame.dirty = frame.held = frame.loading = false;
+        frame.referenced = false;
+        end_change(frame);
+    }
+
+    /*
+     * Allocates the frames for blocks of `block_pages` pages: as many as `page_capacity` pages fill, and at least `min_frames`.
+     */
+    void allocate_frames() {
+        frames = std::vector<Frame>(std::max(page_capacity / block_pages, min_frames));
+        for (auto &frame: frames) {
+            frame.pages.resize(block_pages);
+        }
+        page_table.clear();
+        page_table.reserve(frames.size());
+        // A power of two of slots, several per frame, so few resident blocks share a slot
+        std::size_t slots = 1;
+        while (slots < 4 * frames.size()) {
+            slots *= 2;
+        }
+        resident = std::vector<std::atomic<std::size_t>>(slots);
+        clock_hand = 0;
+    }
+
+public:
+    /*
+     * Constructs a pool of `capacity` pages over `file`.
+     * At least `min_frames` frames are always allocated, and at least 4, since a split pins two pages at the same time.
+     */
+    BufferPool(File &file, std::size_t capacity, std::size_t min_frames = 4) : file(file), page_capacity(capacity), min_frames(std::max<std::size_t>(min_frames, 4)) {
+        allocate_frames();
+    }
+
+    BufferPool(const BufferPool &) = delete;
+
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /*
+     * Pins the page at position page_ref, reading its block from disk if it is not resident.
+     * Accesses to disk: O(1) on a miss (plus one write if the evicted block was dirty), none on a hit.
+     */
+    PageType &pin(long page_ref) {
+        std::unique_lock<std::mutex> lock(latch);
+        long block_ref = block_of(page_ref);
+        auto it = find_block(lock, block_ref);
+        if (it != page_table.end()) {
+            Frame &frame = frames[it->second];
+            ++frame.pin_count;
+            frame.referenced = true;
+            return page_of(frame, page_ref);
+        }
+        std::size_t frame_index = acquire_frame(block_ref);
+        Frame &frame = frames[frame_index];
+        bool read;
+        try {
+            read = finish_read(frame, file.read((char *) frame.pages.data(), block_pages * sizeof(PageType), block_ref), page_ref - block_ref + sizeof(PageType));
+        } catch (...) {
+            release_frame(frame_index);
+            throw;
+        }
+        if (!read) {
+            release_frame(frame_index);
+            throw std::runtime_error("Could not read page from file.");
+        }
+        end_change(frame);
+        return page_of(frame, page_ref);
+    }
+
+    /*
+     * Runs `read(page)` on the page at position page_ref if it is resident, without taking the latch or pinning the page,
+     * so readers of resident pages do not contend (the only write to the pool is the reference bit, once the CLOCK algorithm clears it).
+     * Returns `false` if the page was not found resident, or if its frame was given to another block while `read` ran:
+     * whatever `read` saw must then be discarded (and the page pinned instead). Since the page may change while `read` runs,
+     * `read` must only copy it (with atomic accesses) and look at the copy once `read_resident` returns `true`.
+     * Accesses to disk: none.
+     */
+    template<typename Read>
+    bool read_resident(long page_ref, Read read) {
+        long block_ref = block_of(page_ref);
+        Frame *frame = find_resident(block_ref);
+        if (frame == nullptr) {
+            return false;
+        }
+        std::size_t before = frame->version.load(std::memory_order_acquire);
+        if (before % 2 != 0 || frame->block_ref.load(std::memory_order_relaxed) != block_ref) {
+            return false;
+        }
+        read((const PageType &) page_of(*frame, page_ref));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (frame->version.load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+        if (!frame->referenced.load(std::memory_order_relaxed)) {
+            frame->referenced.store(true, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool is_resident(long page_ref) const {
+        std::lock_guard<std::mutex> lock(latch);
+        return page_table.count(block_of(page_ref)) != 0;
+    }
+
+    /*
+     * Reads the blocks of the pages that are not resident with a single batch of reads (see DiskFile::read_batch), so that the next `pin`
+     * of each one is a hit (unless it is evicted first, when the pool cannot hold every block). The pages are left unpinned.
+     * The batch is read without holding the latch, so other threads use the pool meanwhile (a `pin` of a page being read waits for it),
+     * and the latch is not taken at all if every block is found resident (see `find_resident`).
+     * Accesses to disk: one batch of reads of the blocks not resident, none if every page is resident.
+     */
+    void prefetch(const std::vector<long> &page_refs) {
+        // Without the latch if every block is found resident
+        bool resident_blocks = std::all_of(page_refs.begin(), page_refs.end(), [&](long page_ref) {
+            return find_resident(block_of(page_ref)) != nullptr;
+        });
+        if (resident_blocks) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(latch);
+        std::vector<IoRequest> requests;
+        std::vector<std::size_t> frame_indexes;
+        std::vector<std::size_t> needed;
+        for (long page_ref: page_refs) {
+            long block_ref = block_of(page_ref);
+            std::size_t page_end = page_ref - block_ref + sizeof(PageType);
+            auto it = page_table.find(block_ref);
+            if (it != page_table.end()) {
+                // Another page of a block read by this batch
+                for (std::size_t i = 0; i < frame_indexes.size(); ++i) {
+                    if (frame_indexes[i] == it->second) {
+                        needed[i] = std::max(needed[i], page_end);
+                    }
+                }
+                continue;
+            }
+            // Blocks being read stay pinned until their batch completes: leave room for the pages pinned by other users
+            if (loading_blocks == frames.size() / 2) {
+                break;
+            }
+            std::size_t frame_index = acquire_frame(block_ref);
+            frames[frame_index].loading = true;
+            ++loading_blocks;
+            frame_indexes.push_back(frame_index);
+            needed.push_back(page_end);
+            requests.push_back(IoRequest{(char *) frames[frame_index].pages.data(), block_pages * sizeof(PageType), block_ref});
+        }
+        if (requests.empty()) {
+            return;
+        }
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            file.read_batch(requests);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        bool failed = false;
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            Frame &frame = frames[frame_indexes[i]];
+            frame.loading = false;
+            if (error || !finish_read(frame, requests[i].done, needed[i])) {
+                release_frame(frame_indexes[i]);
+                failed = true;
+            } else {
+                frame.pin_count = 0;
+                end_change(frame);
+            }
+        }
+        loading_blocks -= requests.size();
+        loaded.notify_all();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (failed) {
+            throw std::runtime_error("Could not read page from file.");
+        }
+    }
+
+    /*
+     * Pins a freshly allocated page at position page_ref without reading the page itself from disk.
+     * The page is default-initialized and marked dirty, so it reaches the file on eviction or flush.
+     * If its block holds other pages, the block is read first (unless it is resident), since it is written back whole.
+     * Accesses to disk: O(1) if the block holds other pages and is not resident, none otherwise.
+     */
+    PageType &pin_new(long page_ref) {
+        std::unique_lock<std::mutex> lock(latch);
+        long block_ref = block_of(page_ref);
+        auto it = find_block(lock, block_ref);
+        std::size_t frame_index;
+        if (it != page_table.end()) {
+            frame_index = it->second;
+            ++frames[frame_index].pin_count;
+        } else {
+            frame_index = acquire_frame(block_ref);
+            if (block_pages > 1) {
+                try {
+                    finish_read(frames[frame_index], file.read((char *) frames[frame_index].pages.data(), block_pages * sizeof(PageType), block_ref), 0);
+                } catch (...) {
+                    release_frame(frame_index);
+                    throw;
+                }
+            }
+            end_change(frames[frame_index]);
+        }
+        Frame &frame = frames[frame_index];
+        PageType &page = page_of(frame, page_ref);
+        page = PageType{};
+        frame.dirty = true;
+        hold(frame, page_ref);
+        return page;
+    }
+
+    /*
+     * Releases a page previously pinned. If `dirty` is `true`, the page will be written back before leaving the pool.
+     */
+    void unpin(long page_ref, bool dirty = false) {
+        std::lock_guard<std::mutex> lock(latch);
+        auto it = page_table.find(block_of(page_ref));
+        if (it == page_table.end() || frames[it->second].pin_count == 0) {
+            throw std::runtime_error("Cannot unpin a page that is not pinned.");
+        }
+        Frame &frame = frames[it->second];
+        --frame.pin_count;
+        frame.dirty = frame.dirty || dirty;
+        if (dirty) {
+            hold(frame, page_ref);
+        }
+    }
+
+    /*
+     * Starts holding the pages modified from now on (through `unpin` with `dirty` set, or `pin_new`) in the pool.
+     */
+    void hold_modified_pages() {
+        std::lock_guard<std::mutex> lock(latch);
+        holding = true;
+    }
+
+    /*
+     * Stops holding pages. Returns the pages held since `hold_modified_pages`, which can be evicted again.
+     */
+    std::vector<long> release_held_pages() {
+        std::lock_guard<std::mutex> lock(latch);
+        for (long page_ref: held_pages) {
+            frames[page_table.at(block_of(page_ref))].held = false;
+        }
+        holding = false;
+        std::vector<long> released;
+        released.swap(held_pages);
+        return released;
+    }
+
+    /*
+     * Sets the bytes of the file taken by every block (at least sizeof(PageType)). A block holds size / sizeof(PageType) pages,
+     * one after the other from its start, and is written padded with zeros up to that size.
+     * With a single page per block, pages may be at any position; otherwise blocks are aligned to their size.
+     * The frames are reallocated for blocks of the new size, so every page is dropped without being written back (no page may be pinned).
+     */
+    void set_block_size(std::size_t size) {
+        std::lock_guard<std::mutex> lock(latch);
+        block_size = std::max(size, sizeof(PageType));
+        block_pages = block_size / sizeof(PageType);
+        padding.assign(block_size - block_pages * sizeof(PageType), 0);
+        allocate_frames();
+        holding = false;
+        held_pages.clear();
+    }
+
+    /*
+     * Sets a function called before any dirty page is written to the file (e.g. to enforce write-ahead logging).
+     */
+    void set_before_write_back(std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(latch);
+        before_write_back = std::move(callback);
+    }
+
+    /*
+     * Writes every dirty block back to disk. Pages stay resident.
+     * Blocks that are adjacent in the file are written by a single vectored write, and every run is submitted at once (see DiskFile::write_batch),
+     * so e.g. the two pages of a split cost a single submission.
+     * Accesses to disk: O(r) where r is the number of runs of dirty blocks that are adjacent in the file.
+     */
+    void flush() {
+        std::lock_guard<std::mutex> lock(latch);
+        std::vector<Frame *> dirty_frames;
+        for (auto &frame: frames) {
+            if (frame.block_ref != -1 && frame.dirty) {
+                dirty_frames.push_back(&frame);
+            }
+        }
+        std::sort(dirty_frames.begin(), dirty_frames.end(), [](Frame *a, Frame *b) {
+            return a->block_ref < b->block_ref;
+        });
+        if (!dirty_frames.empty() && before_write_back) {
+            before_write_back();
+        }
+        // Blocks that are adjacent in the file are written together with a single vectored write (each one followed by its padding, if any)
+        int block_vectors = padding.empty() ? 1 : 2;
+        std::vector<iovec> vectors(dirty_frames.size() * block_vectors);
+        std::vector<IoVectorRequest> runs;
+        for (std::size_t i = 0; i < dirty_frames.size(); ++i) {
+            iovec *block_vector = &vectors[i * block_vectors];
+            block_vector[0] = iovec{dirty_frames[i]->pages.data(), block_pages * sizeof(PageType)};
+            if (!padding.empty()) {
+                block_vector[1] = iovec{padding.data(), padding.size()};
+            }
+            bool first_of_run = i == 0 || dirty_frames[i]->block_ref != dirty_frames[i - 1]->block_ref + (long) block_size || runs.back().count + block_vectors > IOV_MAX;
+            if (first_of_run) {
+                runs.push_back(IoVectorRequest{block_vector, 0, dirty_frames[i]->block_ref});
+            }
+            runs.back().count += block_vectors;
+            runs.back().size += block_size;
+        }
+        file.write_batch(runs);
+        for (auto *frame: dirty_frames) {
+            frame->dirty = false;
+        }
+    }
+
+    /*
+     * Drops every page without writing it back (used when the underlying file is rebuilt from scratch).
+     */
+    void discard() {
+        std::lock_guard<std::mutex> lock(latch);
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i].block_ref != -1) {
+                release_frame(i);
+            }
+        }
+        page_table.clear();
+        clock_hand = 0;
+        holding = false;
+        held_pages.clear();
+    }
+
+    std::size_t capacity() const {
+        return frames.size();
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_BUFFERPOOL_HPP
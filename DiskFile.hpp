@@ -0,0 +1,634 @@
+#ifndef EXTENDIBLE_HASH_DISKFILE_HPP
+#define EXTENDIBLE_HASH_DISKFILE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "IoUring.hpp"
+
+/*
+ * Alignment of buffers, offsets and sizes of O_DIRECT transfers (covers both 512 byte and 4 KiB sector devices).
+ */
+
+#ifndef DIRECT_IO_ALIGNMENT
+#define DIRECT_IO_ALIGNMENT 4096
+#endif
+
+/*
+ * Heap buffer aligned to DIRECT_IO_ALIGNMENT that grows on demand.
+ */
+class AlignedBuffer {
+    char *data = nullptr;    // < Aligned memory
+    std::size_t capacity = 0;// < Size of the aligned memory in bytes
+
+public:
+    AlignedBuffer() = default;
+
+    AlignedBuffer(const AlignedBuffer &) = delete;
+
+    AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+    /*
+     * Returns a buffer of at least `size` bytes. Previous contents are not preserved when it grows.
+     */
+    char *reserve(std::size_t size) {
+        if (size > capacity) {
+            std::free(data);
+            data = nullptr;
+            capacity = 0;
+            void *memory = nullptr;
+            if (::posix_memalign(&memory, DIRECT_IO_ALIGNMENT, size) != 0) {
+                throw std::runtime_error("Could not allocate aligned buffer.");
+            }
+            data = (char *) memory;
+            capacity = size;
+        }
+        return data;
+    }
+
+    ~AlignedBuffer() {
+        std::free(data);
+    }
+};
+
+/*
+ * Expected access pattern of a file, used to tune the kernel readahead.
+ */
+enum class AccessPattern {
+    Normal,    // < Default readahead
+    Sequential,// < Aggressive readahead (scans)
+    Random     // < No readahead (point lookups)
+};
+
+/*
+ * Thin wrapper over a POSIX file descriptor.
+ * All accesses are positional (pread/pwrite), so there is no shared seek position to keep track of,
+ * and the file can stay open for as long as its owner needs it.
+ * A file can also be mapped read-only in memory, so it can be accessed by pointer without any syscall.
+ * In direct mode (O_DIRECT) the page cache is bypassed: transfers go through aligned bounce buffers,
+ * and the unaligned edges of a write are read, patched and written back, so callers keep using arbitrary offsets and sizes.
+ */
+class DiskFile {
+    int fd = -1;                      // < Underlying file descriptor (-1 when closed)
+    bool direct = false;              // < Is `true` if the file was opened with O_DIRECT
+    char *mapping = nullptr;          // < Read-only memory mapping of the whole file (if mapped)
+    std::size_t mapping_size = 0;     // < Size of the mapping in bytes
+    std::atomic<bool> unsynced{false};// < Is `true` if the file was modified since the last sync (set by writes of any thread)
+
+    static long align_down(long offset) {
+        return offset - offset % DIRECT_IO_ALIGNMENT;
+    }
+
+    static long align_up(long offset) {
+        return align_down(offset + DIRECT_IO_ALIGNMENT - 1);
+    }
+
+    /*
+     * Reads until `size` bytes are read or the end of the file is reached.
+     * A short O_DIRECT read that stops at a block boundary is continued; one that stops inside a block can only mean
+     * the end of the file (and the next read would not be aligned).
+     */
+    std::size_t read_fully(char *buffer, std::size_t size, long offset) {
+        std::size_t total = 0;
+        while (total < size) {
+            ssize_t bytes = ::pread(fd, buffer + total, size - total, offset + (long) total);
+            if (bytes == 0) {
+                break;
+            }
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Could not read from file.");
+            }
+            total += bytes;
+            if (direct && total % DIRECT_IO_ALIGNMENT != 0) {
+                break;
+            }
+        }
+        return total;
+    }
+
+    /*
+     * Reads into several buffers starting at `offset` until they are full or the end of the file is reached.
+     * Returns the amount of bytes read.
+     */
+    std::size_t read_vectored_fully(const iovec *vector, int count, long offset) {
+        std::vector<iovec> pending(vector, vector + count);
+        std::size_t first = 0;
+        std::size_t total = 0;
+        while (first < pending.size()) {
+            ssize_t bytes = ::preadv(fd, pending.data() + first, (int) std::min<std::size_t>(pending.size() - first, IOV_MAX), offset);
+            if (bytes == 0) {
+                break;
+            }
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Could not read from file.");
+            }
+            offset += bytes;
+            total += bytes;
+            // Skip the buffers already filled
+            while (first < pending.size() && (std::size_t) bytes >= pending[first].iov_len) {
+                bytes -= (ssize_t) pending[first].iov_len;
+                ++first;
+            }
+            if (first < pending.size()) {
+                pending[first].iov_base = (char *) pending[first].iov_base + bytes;
+                pending[first].iov_len -= bytes;
+            }
+        }
+        return total;
+    }
+
+    void write_fully(const iovec *vector, int count, long offset) {
+        unsynced = true;
+        std::vector<iovec> pending(vector, vector + count);
+        std::size_t first = 0;
+        while (first < pending.size()) {
+            ssize_t bytes = ::pwritev(fd, pending.data() + first, (int) std::min<std::size_t>(pending.size() - first, IOV_MAX), offset);
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Could not write to file.");
+            }
+            offset += bytes;
+            // Skip the buffers already written
+            while (first < pending.size() && (std::size_t) bytes >= pending[first].iov_len) {
+                bytes -= (ssize_t) pending[first].iov_len;
+                ++first;
+            }
+            if (first < pending.size()) {
+                pending[first].iov_base = (char *) pending[first].iov_base + bytes;
+                pending[first].iov_len -= bytes;
+            }
+        }
+    }
+
+public:
+    DiskFile() = default;
+
+    DiskFile(const DiskFile &) = delete;
+
+    DiskFile &operator=(const DiskFile &) = delete;
+
+    static bool exists(const std::string &file_name) {
+        return ::access(file_name.c_str(), F_OK) == 0;
+    }
+
+    /*
+     * Opens a file, creating it if it does not exist.
+     * If `direct_io` is `true` the file is opened with O_DIRECT, unless the file system does not support it.
+     * Throws an exception if the file could not be opened.
+     */
+    void open(const std::string &file_name, int flags = O_RDWR | O_CREAT, bool direct_io = false) {
+        close();
+        direct = false;
+        unsynced = false;
+        if (direct_io) {
+            fd = ::open(file_name.c_str(), flags | O_DIRECT, 0644);
+            if (fd != -1) {
+                direct = true;
+                return;
+            }
+            if (errno != EINVAL) {
+                throw std::runtime_error("Could not open file.");
+            }
+        }
+        fd = ::open(file_name.c_str(), flags, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Could not open file.");
+        }
+    }
+
+    bool is_open() const {
+        return fd != -1;
+    }
+
+    bool is_direct() const {
+        return direct;
+    }
+
+    void close() {
+        unmap();
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    /*
+     * Reads up to `size` bytes starting at `offset`.
+     * Returns the amount of bytes read, which is smaller than `size` only when the end of the file is reached.
+     */
+    std::size_t read(char *buffer, std::size_t size, long offset) {
+        if (!direct) {
+            return read_fully(buffer, size, offset);
+        }
+        static thread_local AlignedBuffer bounce;
+        long start = align_down(offset);
+        long end = align_up(offset + (long) size);
+        char *aligned = bounce.reserve(end - start);
+        std::size_t bytes = read_fully(aligned, end - start, start);
+        if (bytes <= (std::size_t) (offset - start)) {
+            return 0;
+        }
+        std::size_t available = std::min(size, bytes - (offset - start));
+        std::memcpy(buffer, aligned + (offset - start), available);
+        return available;
+    }
+
+    /*
+     * Reads a batch of independent requests.
+     * Every request is submitted at once through io_uring (one ring per thread), falling back to pread
+     * for the requests io_uring could not complete or when it's unavailable.
+     * Requests that reach the end of the file keep done < size.
+     */
+    void read_batch(std::vector<IoRequest> &requests) {
+        static thread_local IoUring ring;
+        if (!direct) {
+            ring.read(fd, requests.data(), requests.size());
+            for (auto &request: requests) {
+                if (request.done < request.size) {
+                    request.done += read(request.buffer + request.done, request.size - request.done, request.offset + (long) request.done);
+                }
+            }
+            return;
+        }
+        // Read the aligned blocks that contain every request into one aligned arena
+        static thread_local AlignedBuffer arena;
+        std::vector<IoRequest> aligned_requests(requests.size());
+        std::size_t arena_size = 0;
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            long start = align_down(requests[i].offset);
+            long end = align_up(requests[i].offset + (long) requests[i].size);
+            aligned_requests[i].size = end - start;
+            aligned_requests[i].offset = start;
+            arena_size += end - start;
+        }
+        char *aligned = arena.reserve(arena_size);
+        for (auto &aligned_request: aligned_requests) {
+            aligned_request.buffer = aligned;
+            aligned += aligned_request.size;
+        }
+        ring.read(fd, aligned_requests.data(), aligned_requests.size());
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            IoRequest &aligned_request = aligned_requests[i];
+            if (aligned_request.done < aligned_request.size) {
+                // io_uring stopped short (or is unavailable): continue from the last whole block read, until the end of the file
+                std::size_t done = aligned_request.done - aligned_request.done % DIRECT_IO_ALIGNMENT;
+                aligned_request.done = done + read_fully(aligned_request.buffer + done, aligned_request.size - done, aligned_request.offset + (long) done);
+            }
+            std::size_t skip = requests[i].offset - aligned_request.offset;
+            requests[i].done = aligned_request.done > skip ? std::min(requests[i].size, aligned_request.done - skip) : 0;
+            std::memcpy(requests[i].buffer, aligned_request.buffer + skip, requests[i].done);
+        }
+    }
+
+    /*
+     * Reads a batch of requests in offset order, merging the ones that are adjacent or separated by at most `max_gap` bytes
+     * into a single vectored read (the bytes in between are read into a scratch buffer and discarded).
+     * A batch that covers a large part of the file thus becomes a near-sequential scan.
+     * Merged reads are submitted at once through io_uring when available, falling back to preadv.
+     * Overlapping requests are read separately. Requests that reach the end of the file keep done < size.
+     */
+    void read_coalesced(std::vector<IoRequest> &requests, std::size_t max_gap) {
+        struct Run {
+            std::size_t first = 0;// < Position of the first request of the run in `order`
+            std::size_t last = 0; // < Position of the last request of the run in `order`
+            long offset = 0;      // < Position of the run in the file
+            std::size_t size = 0; // < Amount of bytes covered by the run (including gaps)
+        };
+        std::vector<std::size_t> order(requests.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return requests[a].offset < requests[b].offset;
+        });
+        // Group the requests into runs of nearby requests
+        std::vector<Run> runs;
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            IoRequest &request = requests[order[i]];
+            if (!runs.empty()) {
+                Run &run = runs.back();
+                long run_end = run.offset + (long) run.size;
+                bool nearby = request.offset >= run_end && request.offset - run_end <= (long) max_gap;
+                // Each request takes up to 2 buffers (gap and data)
+                if (nearby && 2 * (i - run.first + 1) <= IOV_MAX) {
+                    run.last = i;
+                    run.size = request.offset + (long) request.size - run.offset;
+                    continue;
+                }
+            }
+            runs.push_back(Run{i, i, request.offset, request.size});
+        }
+        std::vector<char> scratch(max_gap);
+        std::vector<iovec> vectors;
+        vectors.reserve(2 * requests.size());
+        std::vector<IoVectorRequest> vector_requests;
+        for (auto &run: runs) {
+            IoVectorRequest vector_request{vectors.data() + vectors.size(), 0, run.offset, run.size};
+            long position = run.offset;
+            for (std::size_t i = run.first; i <= run.last; ++i) {
+                IoRequest &request = requests[order[i]];
+                if (request.offset > position) {
+                    vectors.push_back(iovec{scratch.data(), (std::size_t) (request.offset - position)});
+                    ++vector_request.count;
+                }
+                vectors.push_back(iovec{request.buffer, request.size});
+                ++vector_request.count;
+                position = request.offset + (long) request.size;
+            }
+            vector_requests.push_back(vector_request);
+        }
+        if (direct) {
+            // O_DIRECT requires aligned buffers: read each run through the bounce buffer
+            std::vector<char> staging;
+            for (auto &vector_request: vector_requests) {
+                staging.resize(vector_request.size);
+                vector_request.done = read(staging.data(), vector_request.size, vector_request.offset);
+                std::size_t position = 0;
+                for (int i = 0; i < vector_request.count && position < vector_request.done; ++i) {
+                    std::size_t length = std::min(vector_request.vector[i].iov_len, vector_request.done - position);
+                    std::memcpy(vector_request.vector[i].iov_base, staging.data() + position, length);
+                    position += vector_request.vector[i].iov_len;
+                }
+            }
+        } else {
+            static thread_local IoUring ring;
+            ring.read_vectored(fd, vector_requests.data(), vector_requests.size());
+            for (auto &vector_request: vector_requests) {
+                if (vector_request.done < vector_request.size) {
+                    // Continue where io_uring stopped (or from the start if it's unavailable)
+                    std::vector<iovec> remaining(vector_request.vector, vector_request.vector + vector_request.count);
+                    std::size_t skip = vector_request.done;
+                    std::size_t first = 0;
+                    while (first < remaining.size() && skip >= remaining[first].iov_len) {
+                        skip -= remaining[first].iov_len;
+                        ++first;
+                    }
+                    if (first < remaining.size()) {
+                        remaining[first].iov_base = (char *) remaining[first].iov_base + skip;
+                        remaining[first].iov_len -= skip;
+                        vector_request.done += read_vectored_fully(remaining.data() + first, (int) (remaining.size() - first), vector_request.offset + (long) vector_request.done);
+                    }
+                }
+            }
+        }
+        // Distribute the bytes read by each run among its requests
+        for (std::size_t r = 0; r < runs.size(); ++r) {
+            for (std::size_t i = runs[r].first; i <= runs[r].last; ++i) {
+                IoRequest &request = requests[order[i]];
+                long relative = request.offset - runs[r].offset;
+                long available = (long) vector_requests[r].done - relative;
+                request.done = available > 0 ? std::min<std::size_t>(request.size, available) : 0;
+            }
+        }
+    }
+
+    /*
+     * Writes exactly `size` bytes starting at `offset`.
+     */
+    void write(const char *buffer, std::size_t size, long offset) {
+        iovec vector{(void *) buffer, size};
+        write_vectored(&vector, 1, offset);
+    }
+
+    /*
+     * Writes several buffers to consecutive positions of the file starting at `offset`, in a single call.
+     */
+    void write_vectored(const iovec *vector, int count, long offset) {
+        if (!direct) {
+            write_fully(vector, count, offset);
+            return;
+        }
+        std::size_t size = 0;
+        for (int i = 0; i < count; ++i) {
+            size += vector[i].iov_len;
+        }
+        static thread_local AlignedBuffer bounce;
+        long start = align_down(offset);
+        long end = align_up(offset + (long) size);
+        char *aligned = bounce.reserve(end - start);
+        long file_size = this->size();
+        // Preserve the bytes of the first and last blocks that are not overwritten
+        if (offset != start) {
+            std::memset(aligned, 0, DIRECT_IO_ALIGNMENT);
+            read_fully(aligned, DIRECT_IO_ALIGNMENT, start);
+        }
+        if (offset + (long) size != end && (end - DIRECT_IO_ALIGNMENT != start || offset == start)) {
+            char *last_block = aligned + (end - DIRECT_IO_ALIGNMENT - start);
+            std::memset(last_block, 0, DIRECT_IO_ALIGNMENT);
+            read_fully(last_block, DIRECT_IO_ALIGNMENT, end - DIRECT_IO_ALIGNMENT);
+        }
+        char *position = aligned + (offset - start);
+        for (int i = 0; i < count; ++i) {
+            std::memcpy(position, vector[i].iov_base, vector[i].iov_len);
+            position += vector[i].iov_len;
+        }
+        iovec aligned_vector{aligned, (std::size_t) (end - start)};
+        write_fully(&aligned_vector, 1, start);
+        // Drop the padding written past the end of the file
+        if (end > file_size && offset + (long) size < end) {
+            truncate(std::max(file_size, offset + (long) size));
+        }
+    }
+
+    /*
+     * Writes a batch of independent vectored requests (e.g. runs of pages at different positions).
+     * Every request is submitted at once through io_uring (one ring per thread), falling back to pwritev
+     * for the requests io_uring could not complete or when it's unavailable.
+     */
+    void write_batch(std::vector<IoVectorRequest> &requests) {
+        if (!direct) {
+            static thread_local IoUring ring;
+            unsynced = true;
+            ring.write_vectored(fd, requests.data(), requests.size());
+        }
+        for (auto &request: requests) {
+            if (request.done < request.size) {
+                // Writing the same bytes again is harmless
+                write_vectored(request.vector, request.count, request.offset);
+                request.done = request.size;
+            }
+        }
+    }
+
+    /*
+     * Reserves disk space for the range [offset, offset + length) without changing the size of the file,
+     * so a file that grows by small appends keeps its blocks contiguous. Does nothing if the file system does not support it.
+     */
+    void preallocate(long offset, long length) {
+#ifdef FALLOC_FL_KEEP_SIZE
+        ::fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+    }
+
+    /*
+     * Returns the current size of the file in bytes.
+     */
+    long size() const {
+        struct stat file_stat {};
+        if (::fstat(fd, &file_stat) == -1) {
+            throw std::runtime_error("Could not stat file.");
+        }
+        return file_stat.st_size;
+    }
+
+    /*
+     * Maps the whole file read-only in memory (kernel-managed caching, no copies).
+     * The mapping reflects the size of the file at the moment of the call.
+     */
+    void map() {
+        unmap();
+        mapping_size = size();
+        if (mapping_size == 0) {
+            return;
+        }
+        void *address = ::mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            mapping_size = 0;
+            throw std::runtime_error("Could not map file.");
+        }
+        mapping = (char *) address;
+    }
+
+    void unmap() {
+        if (mapping != nullptr) {
+            ::munmap(mapping, mapping_size);
+            mapping = nullptr;
+        }
+        mapping_size = 0;
+    }
+
+    bool is_mapped() const {
+        return mapping != nullptr;
+    }
+
+    /*
+     * Returns a pointer to `size` mapped bytes starting at `offset`.
+     * Throws an exception if the range is outside of the mapping.
+     */
+    const char *mapped(long offset, std::size_t size) const {
+        if (offset < 0 || (std::size_t) offset + size > mapping_size) {
+            throw std::runtime_error("Access outside of the mapped file.");
+        }
+        return mapping + offset;
+    }
+
+    /*
+     * Tells the kernel how the file is going to be accessed from now on (applies to the mapping too, if any).
+     * Hints are only advisory, so failures are ignored.
+     */
+    void advise(AccessPattern pattern) {
+        int advice = POSIX_FADV_NORMAL;
+        int map_advice = MADV_NORMAL;
+        if (pattern == AccessPattern::Sequential) {
+            advice = POSIX_FADV_SEQUENTIAL;
+            map_advice = MADV_SEQUENTIAL;
+        } else if (pattern == AccessPattern::Random) {
+            advice = POSIX_FADV_RANDOM;
+            map_advice = MADV_RANDOM;
+        }
+        ::posix_fadvise(fd, 0, 0, advice);
+        if (mapping != nullptr) {
+            ::madvise(mapping, mapping_size, map_advice);
+        }
+    }
+
+    /*
+     * Returns, for every page of the range [offset, offset + length), whether it is currently cached in RAM.
+     * `offset` must be a multiple of the page size. If residency cannot be determined, every page is reported as cached.
+     */
+    std::vector<bool> cached_pages(long offset, long length) {
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        std::size_t pages = (length + page_size - 1) / page_size;
+        std::vector<bool> cached(pages, true);
+        long available = std::min(length, size() - offset);
+        if (available <= 0) {
+            return cached;
+        }
+        void *address = ::mmap(nullptr, available, PROT_READ, MAP_SHARED, fd, offset);
+        if (address == MAP_FAILED) {
+            return cached;
+        }
+        std::vector<unsigned char> residency((available + page_size - 1) / page_size);
+        if (::mincore(address, available, residency.data()) == 0) {
+            for (std::size_t i = 0; i < residency.size(); ++i) {
+                cached[i] = residency[i] & 1;
+            }
+        }
+        ::munmap(address, available);
+        return cached;
+    }
+
+    /*
+     * Drops the cached pages of the range [offset, offset + length) (POSIX_FADV_DONTNEED),
+     * except the pages flagged in `keep` (as returned by `cached_pages`).
+     */
+    void drop_cached_pages(long offset, long length, const std::vector<bool> &keep) {
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        std::size_t pages = (length + page_size - 1) / page_size;
+        std::size_t first = 0;
+        while (first < pages) {
+            if (first < keep.size() && keep[first]) {
+                ++first;
+                continue;
+            }
+            std::size_t last = first;
+            while (last + 1 < pages && !(last + 1 < keep.size() && keep[last + 1])) {
+                ++last;
+            }
+            ::posix_fadvise(fd, offset + (long) first * page_size, (long) (last - first + 1) * page_size, POSIX_FADV_DONTNEED);
+            first = last + 1;
+        }
+    }
+
+    void truncate(long size) {
+        unsynced = true;
+        if (::ftruncate(fd, size) == -1) {
+            throw std::runtime_error("Could not truncate file.");
+        }
+    }
+
+    /*
+     * Forces the data written so far to stable storage (fdatasync: metadata not needed to read the data back is not flushed).
+     * Does nothing if the file was not modified since the last sync, so syncing several files costs one fdatasync per modified file.
+     */
+    void sync() {
+        // Cleared before syncing, so a write that runs concurrently is synced by the next call
+        if (!unsynced.exchange(false)) {
+            return;
+        }
+        while (::fdatasync(fd) == -1) {
+            if (errno != EINTR) {
+                unsynced = true;
+                throw std::runtime_error("Could not sync file.");
+            }
+        }
+    }
+
+    ~DiskFile() {
+        close();
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_DISKFILE_HPP
@@ -1,12 +1,39 @@
 #ifndef EXTENDIBLE_HASH_EXTENDIBLEHASHFILE_HPP
 #define EXTENDIBLE_HASH_EXTENDIBLEHASHFILE_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#include "BufferPool.hpp"
+#include "DiskFile.hpp"
+#include "ExternalSort.hpp"
+#include "HyperLogLog.hpp"
+#include "MappedFile.hpp"
+#include "MemoryFile.hpp"
+#include "RecordCache.hpp"
+#include "ScanCache.hpp"
+#include "ThreadPool.hpp"
+#include "WriteAheadLog.hpp"
+
 /*
  * File I/O Macro definitions
  */
@@ -53,6 +80,143 @@
 
 #define BLOCK_SIZE 256
 
+/*
+ * Amount of RAM (in bytes) reserved for the bucket buffer pool of each index.
+ */
+
+#ifndef BUFFER_POOL_SIZE
+#define BUFFER_POOL_SIZE (4 * 1024 * 1024)
+#endif
+
+/*
+ * Amount of RAM (in bytes) reserved for caching records of the raw data file in each index.
+ */
+
+#ifndef RECORD_CACHE_SIZE
+#define RECORD_CACHE_SIZE (8 * 1024 * 1024)
+#endif
+
+/*
+ * Matching records of the raw data file separated by at most this amount of bytes are fetched with a single read.
+ */
+
+#ifndef RECORD_COALESCE_GAP
+#define RECORD_COALESCE_GAP (32 * 1024)
+#endif
+
+/*
+ * Size (in bytes) of the chunks in which a full scan of the raw data file reads it (two chunks are kept in memory).
+ */
+
+#ifndef SCAN_CHUNK_SIZE
+#define SCAN_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+
+/*
+ * The hash file grows in extents of this size (in bytes), reserved with fallocate, so buckets appended one at a time stay physically contiguous.
+ */
+
+#ifndef HASH_FILE_EXTENT_SIZE
+#define HASH_FILE_EXTENT_SIZE (1024 * 1024)
+#endif
+
+/*
+ * Size (in bytes) the write-ahead log may reach before a checkpoint writes the logged changes in place and empties it.
+ */
+
+#ifndef WAL_CHECKPOINT_SIZE
+#define WAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+#endif
+
+/*
+ * Amount of RAM (in bytes) `create_index` uses to sort the keys of the records. Larger sets of keys are sorted in runs on disk.
+ */
+
+#ifndef BUILD_MEMORY_SIZE
+#define BUILD_MEMORY_SIZE (256 * 1024 * 1024)
+#endif
+
+/*
+ * Threads used by default to build an index (one per core).
+ */
+
+#ifndef BUILD_THREADS
+#define BUILD_THREADS (std::max(1u, std::thread::hardware_concurrency()))
+#endif
+
+/*
+ * A parallel build only splits the keys in as many partitions as each one is expected to get at least this amount of records.
+ */
+
+#ifndef BUILD_PARTITION_MIN_RECORDS
+#define BUILD_PARTITION_MIN_RECORDS (64 * 1024)
+#endif
+
+/*
+ * Size (in bytes) of the batches of records whose keys are hashed by a single thread in a parallel build.
+ */
+
+#ifndef BUILD_BATCH_SIZE
+#define BUILD_BATCH_SIZE (1024 * 1024)
+#endif
+
+/*
+ * A parallel build only splits the keys in as many partitions as each one is expected to get at least this amount of distinct keys
+ * (the records of a key all go to the same partition).
+ */
+
+#ifndef BUILD_PARTITION_MIN_KEYS
+#define BUILD_PARTITION_MIN_KEYS 16
+#endif
+
+/*
+ * Amount of records sampled to estimate the amount of distinct keys before a parallel build.
+ */
+
+#ifndef BUILD_SAMPLE_RECORDS
+#define BUILD_SAMPLE_RECORDS (64 * 1024)
+#endif
+
+/*
+ * Threads used by default by `search_many` to search a batch of keys (1 searches it in the calling thread only).
+ */
+
+#ifndef SEARCH_THREADS
+#define SEARCH_THREADS 1
+#endif
+
+/*
+ * `search_many` only spreads a batch among several threads if it has at least this amount of distinct keys.
+ */
+
+#ifndef SEARCH_PARALLEL_MIN_KEYS
+#define SEARCH_PARALLEL_MIN_KEYS 256
+#endif
+
+/*
+ * Amount of bucket chains a thread of a parallel `search_many` claims at a time (their buckets are read in the same batches).
+ */
+
+#ifndef SEARCH_GROUPS_PER_TASK
+#define SEARCH_GROUPS_PER_TASK 32
+#endif
+
+/*
+ * Number of version counters shared by the buckets of each index (a bucket uses the counter of its position modulo this amount).
+ */
+
+#ifndef BUCKET_VERSION_STRIPES
+#define BUCKET_VERSION_STRIPES 64
+#endif
+
+/*
+ * Times a search retries reading bucket chains without latches, because a split overlapped it, before it holds off inserts.
+ */
+
+#ifndef OPTIMISTIC_READ_RETRIES
+#define OPTIMISTIC_READ_RETRIES 8
+#endif
+
 /*
  * Each bucket should fit in RAM.
  * Thus, the equation for determining the maximum amount of records per bucket is given by the sum of the size of its attributes:
@@ -86,6 +250,37 @@ namespace func {
         std::memcpy((char *) &a, b, sizeof(T));
     }
 
+    /*
+     * Copies `size` bytes (a multiple of sizeof(long), between addresses aligned to it) one word at a time with relaxed atomic accesses,
+     * so a copy may overlap a concurrent one: the reader validates it with a version counter (see ExtendibleHashFile::read_bucket).
+     */
+    void atomic_copy(void *destination, const void *source, std::size_t size) {
+        auto *to = (long *) destination;
+        auto *from = (const long *) source;
+        for (std::size_t i = 0; i < size / sizeof(long); ++i) {
+            __atomic_store_n(&to[i], __atomic_load_n(&from[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+    }
+
+    /*
+     * Shard of a key given its hash (see ShardedExtendibleHashFile): the highest `shard_bits` bits of the hash, mixed first,
+     * so they are independent of the lowest bits, which place the key in a bucket (e.g. std::hash of an integer is the integer itself).
+     * The mix (the MurmurHash3 finalizer) differs from the one of HyperLogLog, whose registers are chosen by the highest bits too:
+     * otherwise all the keys of a shard would fall in the same few registers, and the distinct keys of a shard would be underestimated.
+     */
+    std::size_t shard_of(std::size_t hash, std::size_t shard_bits) {
+        if (shard_bits == 0) {
+            return 0;
+        }
+        uint64_t mixed = hash;
+        mixed ^= mixed >> 33;
+        mixed *= 0xff51afd7ed558ccdULL;
+        mixed ^= mixed >> 33;
+        mixed *= 0xc4ceb9fe1a85ec53ULL;
+        mixed ^= mixed >> 33;
+        return (std::size_t) (mixed >> (64 - shard_bits));
+    }
+
     void read_buffer(char buffer[], int size) {
         std::string temp;
         std::getline(std::cin >> std::ws, temp, '\n');
@@ -120,14 +315,12 @@ struct BucketPair {
     }
 
     /*
-     * Copy constructor.
-     * Ensures that a KeyType of char* is properly copied.
+     * Copies are member-wise (a key of char[N] is copied as an array), so pairs stay trivially copyable
+     * and can be written to disk as they are (see ExternalSorter).
      */
-    BucketPair &operator=(const BucketPair &bucket_pair) {
-        func::copy(key, bucket_pair.key);
-        record_ref = bucket_pair.record_ref;
-        return *this;
-    }
+    BucketPair(const BucketPair &) = default;
+
+    BucketPair &operator=(const BucketPair &) = default;
 };
 
 template<typename KeyType>
@@ -155,9 +348,21 @@ struct ExtendibleHashEntry {
     }
 };
 
+/*
+ * The entries are looked up while a single writer splits them (see ExtendibleHashFile::search): their storage is reserved for the
+ * 2^D entries a directory may reach, so it never moves, and new entries are only visible once they are complete.
+ */
 template<typename std::size_t D>
 class ExtendibleHash {
     std::vector<ExtendibleHashEntry<D>> hash_entries;// < Vector containing the entries of the hash
+    std::atomic<std::size_t> entry_count{0};         // < Number of entries visible to lookups
+    std::set<std::size_t> changed_entries;           // < Positions of the entries modified since the last write to disk
+    std::vector<std::size_t> operation_entries;      // < Positions of the entries modified since the last `take_operation_changes`
+
+    void reserve_entries() {
+        hash_entries.reserve(std::max(hash_entries.size(), (std::size_t) 1 << D));
+        entry_count.store(hash_entries.size(), std::memory_order_release);
+    }
 
 public:
     /*
@@ -175,6 +380,14 @@ public:
         entry_1.bucket_ref = bucket_1_ref;
         hash_entries.push_back(entry_0);
         hash_entries.push_back(entry_1);
+        reserve_entries();
+    }
+
+    /*
+     * Constructs a hash from already built entries (see ExtendibleHashFile::create_index).
+     */
+    explicit ExtendibleHash(std::vector<ExtendibleHashEntry<D>> entries) : hash_entries(std::move(entries)) {
+        reserve_entries();
     }
 
     /*
@@ -182,50 +395,73 @@ public:
      * Reads the entire file to memory (should fit in RAM).
      * Accesses to disk: O(1)
      */
-    explicit ExtendibleHash(std::fstream &index_file) {
-        // Get the size of the index file
-        SEEK_ALL_RELATIVE(index_file, 0, std::ios::end)
-        std::size_t index_file_size = TELL(index_file);
-        // Read the entire index file (should fit in RAM)
-        SEEK_ALL(index_file, 0)
-        char *buffer = new char[index_file_size];
-        index_file.read(buffer, (long long) index_file_size);
-        // Unpack the binary char buffer
-        std::stringstream buf{std::string{buffer, index_file_size}};
-        while (!buf.eof()) {
-            ExtendibleHashEntry<D> newEntry;
-            buf.read((char *) &newEntry, sizeof(newEntry));
-            if (!buf.eof()) {
-                hash_entries.push_back(newEntry);
-            }
+    template<typename File>
+    explicit ExtendibleHash(File &index_file) {
+        hash_entries.resize(index_file.size() / sizeof(ExtendibleHashEntry<D>));
+        std::size_t index_size = hash_entries.size() * sizeof(ExtendibleHashEntry<D>);
+        if (index_file.read((char *) hash_entries.data(), index_size, 0) != index_size) {
+            throw std::runtime_error("Could not read directory from file.");
         }
-        delete[] buffer;
+        reserve_entries();
     }
 
     /*
      * Writes the entire index to disk (overwrites the actual contents of the file).
      * Accesses to disk: O(1)
      */
-    void write_to_disk(std::fstream &index_file) {
-        const std::size_t index_size = hash_entries.size() * sizeof(ExtendibleHashEntry<D>);
-        char *buffer = new char[index_size];
-        // Pack the binary char buffer
-        std::stringstream buf{std::string{buffer, index_size}};
-        for (std::size_t i = 0; i < hash_entries.size(); ++i) {
-            buf.write((char *) &(hash_entries[i]), sizeof(hash_entries[i]));
+    template<typename File>
+    void write_to_disk(File &index_file) {
+        index_file.truncate(0);
+        index_file.write((char *) hash_entries.data(), hash_entries.size() * sizeof(ExtendibleHashEntry<D>), 0);
+        changed_entries.clear();
+        operation_entries.clear();
+    }
+
+    /*
+     * Writes only the entries modified or added since the last write, in place.
+     * Entries that are adjacent in the file are written together.
+     * Accesses to disk: O(r) where r is the number of runs of adjacent modified entries
+     */
+    template<typename File>
+    void write_changes(File &index_file) {
+        auto it = changed_entries.begin();
+        while (it != changed_entries.end()) {
+            std::size_t first = *it;
+            std::size_t last = first;
+            while (++it != changed_entries.end() && *it == last + 1) {
+                last = *it;
+            }
+            index_file.write((char *) &hash_entries[first], (last - first + 1) * sizeof(ExtendibleHashEntry<D>), (long) (first * sizeof(ExtendibleHashEntry<D>)));
         }
-        // Write buffer to disk
-        index_file.write(buf.str().c_str(), (long long) index_size);
-        delete[] buffer;
+        changed_entries.clear();
+    }
+
+    bool has_changes() const {
+        return !changed_entries.empty();
     }
 
     /*
-     * Looks for an entry.
-     * Returns a pair containing the position of the entry (first), and the bucket it references (second)
+     * Returns the positions of the entries modified since the last call (the changes of a single operation, to be logged).
      */
-    std::pair<std::size_t, long> lookup(const std::string &hash_sequence) {
-        for (std::size_t i = 0; i < hash_entries.size(); ++i) {
-            auto local_depth = hash_entries[i].local_depth;
+    std::vector<std::size_t> take_operation_changes() {
+        std::vector<std::size_t> changes;
+        changes.swap(operation_entries);
+        return changes;
+    }
+
+    const ExtendibleHashEntry<D> &entry(std::size_t entry_index) const {
+        return hash_entries[entry_index];
+    }
+
+    /*
+     * Looks for an entry without latching the directory: while it's being split, the entry may not be found
+     * (see ExtendibleHashFile::read_chains, which validates the lookup).
+     * Returns a pair containing the position of the entry (first), and the bucket it references (second), or -1 as the position if it was not found.
+     */
+    std::pair<std::size_t, long> find(const std::string &hash_sequence) const {
+        std::size_t count = entry_count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; ++i) {
+            auto local_depth = __atomic_load_n(&hash_entries[i].local_depth, __ATOMIC_RELAXED);
             bool eq = true;
             for (int j = 0; j < local_depth; ++j) {
                 // If the sequences are different given the local depth, this is not the bucket we're looking for
@@ -235,14 +471,28 @@ public:
                 }
             }
             if (eq) {
-                return std::make_pair(i, hash_entries[i].bucket_ref);
+                return std::make_pair(i, __atomic_load_n(&hash_entries[i].bucket_ref, __ATOMIC_ACQUIRE));
             }
         }
-        throw std::runtime_error("Could not find given hash sequence on ExtendibleHash.");
+        return std::make_pair((std::size_t) -1, -1L);
+    }
+
+    /*
+     * Looks for an entry.
+     * Returns a pair containing the position of the entry (first), and the bucket it references (second)
+     */
+    std::pair<std::size_t, long> lookup(const std::string &hash_sequence) {
+        auto found = find(hash_sequence);
+        if (found.first == (std::size_t) -1) {
+            throw std::runtime_error("Could not find given hash sequence on ExtendibleHash.");
+        }
+        return found;
     }
 
     void update_entry_bucket(const std::size_t &entry_index, const long &new_bucket_ref) {
-        hash_entries[entry_index].bucket_ref = new_bucket_ref;
+        __atomic_store_n(&hash_entries[entry_index].bucket_ref, new_bucket_ref, __ATOMIC_RELEASE);
+        changed_entries.insert(entry_index);
+        operation_entries.push_back(entry_index);
     }
 
     /*
@@ -259,10 +509,15 @@ public:
             // Reference the new bucket's position
             entry_1.bucket_ref = new_bucket_ref;
             // Increase the local depth
-            hash_entries[entry_index].local_depth++;
+            __atomic_store_n(&hash_entries[entry_index].local_depth, local_depth + 1, __ATOMIC_RELAXED);
             entry_1.local_depth++;
-            // Add the new entry to the index
+            // Add the new entry to the index (the storage is reserved, so lookups running concurrently never see it move)
             hash_entries.push_back(entry_1);
+            entry_count.store(hash_entries.size(), std::memory_order_release);
+            changed_entries.insert(entry_index);
+            changed_entries.insert(hash_entries.size() - 1);
+            operation_entries.push_back(entry_index);
+            operation_entries.push_back(hash_entries.size() - 1);
             return std::make_pair(true, local_depth);
         } else {
             return std::make_pair(false, 0);
@@ -271,22 +526,64 @@ public:
 };
 
 
+/*
+ * Events on which an ExtendibleHashFile forces its changes to stable storage (fdatasync).
+ * Each level also syncs on the events of the levels before it.
+ */
+enum class Durability {
+    None,        // < Never: the operating system decides when changes reach the disk (fastest, e.g. for bulk rebuilds)
+    OnCheckpoint,// < When `create_index` finishes, on `checkpoint` and on destruction
+    PerBatch,    // < When a group of inserts is committed (see group_commit_size) and on `commit`
+    PerOperation // < Before every `insert` and `remove` returns
+};
+
+/*
+ * Options that control how an ExtendibleHashFile accesses its files.
+ */
+struct ExtendibleHashOptions {
+    bool read_only = false;                           // < Maps the hash and raw data files in memory. Only `search` is allowed
+    bool direct_io = false;                           // < Bypasses the page cache (O_DIRECT). The buffer pool becomes the only cache of buckets
+    std::size_t buffer_pool_size = BUFFER_POOL_SIZE;  // < Amount of RAM (in bytes) used to cache buckets
+    std::size_t record_cache_size = RECORD_CACHE_SIZE;// < Amount of RAM (in bytes) used to cache records of the raw data file (0 disables it)
+    std::size_t group_commit_size = 0;                // < Inserts committed together in group commit mode (0 writes every insert through)
+    std::chrono::milliseconds group_commit_window{10};// < Maximum time an insert waits to be committed in group commit mode
+    bool write_ahead_log = false;                     // < Logs every insert and remove, and writes buckets and directory entries in place on checkpoints
+    std::size_t checkpoint_size = WAL_CHECKPOINT_SIZE;// < Size (in bytes) of the log that triggers a checkpoint
+    Durability durability = Durability::PerBatch;     // < Events on which changes are forced to stable storage
+    std::size_t build_memory_size = BUILD_MEMORY_SIZE;// < Amount of RAM (in bytes) `create_index` may use to sort keys (beyond it, it sorts on disk)
+    std::size_t build_threads = BUILD_THREADS;        // < Threads `create_index` uses to hash keys and build partitions of the index
+    std::size_t search_threads = SEARCH_THREADS;      // < Threads `search_many` uses to follow bucket chains and fetch records of large batches
+    std::size_t shard_bits = 0;                       // < Highest bits of the hash that route keys to shards (see ShardedExtendibleHashFile)
+    std::size_t shard = 0;                            // < Shard of the index: only the keys routed to it are indexed
+};
+
+
 template<typename KeyType,
          typename RecordType,
          std::size_t global_depth = 16,                        // < Maximum depth of the binary index key (defaults to 16)
          typename Index = std::function<KeyType(RecordType &)>,// < Indexing function type
          typename Equal = std::equal_to<KeyType>,              // < Equal comparator type
-         typename Hash = std::hash<KeyType>                    // < Hash type
+         typename Hash = std::hash<KeyType>,                   // < Hash type
+         typename File = DiskFile                              // < Storage backend of the files (DiskFile, MemoryFile or MappedFile)
          >
 class ExtendibleHashFile {
-    std::fstream raw_file;                                                                //< File object used to manage acces to the raw data file (not used if index is already created)
-    std::string raw_file_name;                                                            //< Raw data file name
-    std::fstream index_file;                                                              // < File object used to manage the index
-    std::string index_file_name;                                                          //< Name of index raw_file to be created
-    std::fstream hash_file;                                                               // < File object used to access hash-based indexed file
-    std::string hash_file_name;                                                           // < Hash-based indexed file name
-    std::string unique_id;                                                                // < Index unique identifier (allows to create indexes in more than 1 attribute per table)
-    const std::ios_base::openmode flags = std::ios::in | std::ios::binary | std::ios::out;// < Flags used in all accesses to disk
+    ExtendibleHashOptions options;   // < File access options (declared first, as other members are initialized from it)
+    File raw_file;                   //< File object used to manage acces to the raw data file
+    std::string raw_file_name;       //< Raw data file name
+    File index_file;                 // < File object used to manage the index (kept open, entries are updated in place)
+    std::string index_file_name;     //< Name of index raw_file to be created
+    File hash_file;                  // < File object used to access hash-based indexed file (kept open while buckets are cached)
+    std::string hash_file_name;      // < Hash-based indexed file name
+    WriteAheadLog<File> wal;         // < Log of the changes not checkpointed yet (if enabled)
+    std::string wal_file_name;       // < Write-ahead log file name
+    File mark_file;                  // < File object used to store the high-water mark and the block size (kept open, rewritten in place)
+    std::string mark_file_name;      // < High-water mark file name
+    long indexed_end = 0;            // < High-water mark: every record before this position of the raw data file is indexed
+    bool indexed_end_changed = false;// < Is `true` if the high-water mark was advanced since it was last written
+    long hash_file_end = 0;          // < Position where the next bucket will be allocated
+    long hash_file_reserved = 0;     // < End of the space reserved for the hash file (see HASH_FILE_EXTENT_SIZE)
+    long block_size = 0;             // < Bytes of the blocks of the hash file, none crossed by a bucket (0 until known, see `hash_block_size`)
+    std::string unique_id;           // < Index unique identifier (allows to create indexes in more than 1 attribute per table)
 
     /*
      * Generic purposes member variables
@@ -294,9 +591,151 @@ class ExtendibleHashFile {
     bool primary_key;                        //< Is `true` when indexing a primary key and `false` otherwise
     Index index;                             //< Receives a `RecordType` and returns his `KeyType` associated
     Equal equal;                             //< Returns `true` if the first parameter is greater than the second and `false` otherwise
-    Hash hash_function;                      // < Hash function
-    ExtendibleHash<global_depth> *hash_index;// < Extendible hash index (stored in RAM)
+    Hash hash_function;                                   // < Hash function
+    ExtendibleHash<global_depth> *hash_index = nullptr;   // < Extendible hash index (stored in RAM)
+    BufferPool<Bucket<KeyType>, File> bucket_pool;        // < Cached buckets of the hash file, shared by every operation
+    std::shared_ptr<RecordCache<RecordType>> record_cache;// < Cached records of the raw data file, keyed by record_ref (shared by its indexes)
+
+    /*
+     * Concurrency member variables (acquired in this order)
+     */
+    std::shared_mutex latch;                                                       // < Shared by searches and inserts, exclusive while the index is rebuilt or records are removed
+    std::mutex writer_latch;                                                       // < Serializes the operations that modify the index (the committer runs concurrently with the callers)
+    std::atomic<std::size_t> directory_version{0};                                 // < Odd while an insert splits a bucket or grows a chain (searches retry the chains they followed)
+    std::array<std::atomic<std::size_t>, BUCKET_VERSION_STRIPES> bucket_versions{};// < Odd while an insert modifies a bucket (searches retry copying it)
+    std::unique_ptr<ThreadPool> search_pool;                                       // < Threads that help the callers of `search_many` (nullptr with a single search thread)
 
+    /*
+     * Group commit member variables
+     */
+    // Inserts committed together. Every insert of the group keeps it, to wait for its commit and learn whether it failed
+    struct CommitGroup {
+        bool committed = false;  // < Is `true` once the commit of the group has finished (or failed)
+        std::exception_ptr error;// < Failure of the commit, reported to every insert of the group
+    };
+
+    std::condition_variable group_started;               // < Wakes up the committer when the first insert of a group arrives
+    std::condition_variable group_committed;             // < Wakes up the inserts waiting for their group to be committed
+    std::shared_ptr<CommitGroup> open_group;             // < Group the next inserts join (nullptr until an insert starts one)
+    std::size_t pending_inserts = 0;                     // < Inserts of the open group, applied in memory but not committed yet
+    std::chrono::steady_clock::time_point group_deadline;// < Moment at which the open group must be committed
+    bool stopping = false;                               // < Tells the committer to exit
+    std::exception_ptr commit_error;                     // < Failure of a background commit no insert waits for, reported to the next `commit` or `checkpoint`
+    std::thread committer;                               // < Commits a group when its window expires
+    std::mutex build_latch;                              // < Serializes the hash file accesses of the threads of a parallel build
+
+    /*
+     * Bulk load member types
+     */
+    struct BuildPair {
+        std::size_t order = 0;   // < Lowest global_depth bits of the hash, reversed (see `bucket_order`)
+        std::size_t hash = 0;    // < Hash of the key
+        BucketPair<KeyType> pair;// < Key and position of the record
+    };
+
+    // Sorts pairs by bucket (see `bucket_order`), then by hash (so equal keys are adjacent) and then by position
+    struct BuildOrder {
+        bool operator()(const BuildPair &a, const BuildPair &b) const {
+            if (a.order != b.order) {
+                return a.order < b.order;
+            }
+            if (a.hash != b.hash) {
+                return a.hash < b.hash;
+            }
+            return a.pair.record_ref < b.pair.record_ref;
+        }
+    };
+
+    // Pairs of the records whose hashes have the same lowest bits, built independently of the other partitions
+    struct BuildPartition {
+        std::mutex mutex;                           // < Serializes the threads that add pairs
+        ExternalSorter<BuildPair, BuildOrder> pairs;// < Pairs of the partition, sorted by bucket
+
+        BuildPartition(const std::string &file_prefix, std::size_t memory_budget) : pairs(file_prefix, memory_budget) {}
+    };
+
+    // Part of the trie built by a single thread: either a whole partition, or a bucket that holds several small partitions
+    struct BuildPart {
+        std::size_t depth = 0;                                            // < Depth of the part in the trie
+        std::size_t prefix = 0;                                           // < Lowest `depth` bits of the hashes of the part
+        std::vector<std::size_t> partitions;                              // < Partitions whose pairs form the part
+        std::vector<ExtendibleHashEntry<global_depth>> entries;           // < Directory entries of the part
+        std::future<std::vector<ExtendibleHashEntry<global_depth>>> built;// < Directory entries of a part built by another thread
+    };
+
+    struct BuildState {
+        ExternalSorter<BuildPair, BuildOrder> *pairs = nullptr;// < Pairs to be placed, sorted by bucket
+        std::size_t remaining = 0;                             // < Amount of pairs not placed yet
+        std::deque<BuildPair> lookahead;                       // < Pairs taken from `pairs` but not placed in a bucket yet
+        std::vector<BuildPair> same_hash;                      // < Last pairs placed, which share their hash (to find duplicate primary keys)
+        std::vector<ExtendibleHashEntry<global_depth>> entries;// < Directory entries built so far
+        std::vector<Bucket<KeyType>> buckets;                  // < Buckets built but not written yet (they start at `written_ref`)
+        long written_ref = 0;                                  // < Position of the first bucket not written yet
+        long next_ref = 0;                                     // < Position of the next bucket placed
+        long region_end = 0;                                   // < End of the region of the hash file claimed for the buckets placed
+
+        BuildState() = default;
+
+        // State of a build of every pair of `sorted_pairs`
+        explicit BuildState(ExternalSorter<BuildPair, BuildOrder> *sorted_pairs) : pairs(sorted_pairs), remaining(sorted_pairs->size()) {}
+    };
+
+    /*
+     * Multi-get member types
+     */
+    // Keys searched together whose directory entries point to the same chain of buckets, so the chain is read once for all of them
+    struct ChainGroup {
+        long bucket_ref = -1;         // < Next bucket of the chain to be read
+        std::vector<std::size_t> keys;// < Positions of the keys still being searched in the chain
+    };
+
+
+    /*
+     * Number of buckets that fit in the buffer pool.
+     */
+    static std::size_t pool_capacity(const ExtendibleHashOptions &options) {
+        if (options.read_only) {
+            return 0;
+        }
+        return options.buffer_pool_size / sizeof(Bucket<KeyType>);
+    }
+
+    /*
+     * Number of frames the buffer pool needs at least.
+     * With a write-ahead log, the pool must fit every bucket a single insert can modify (two per split, up to global_depth splits), each maybe in a different block.
+     */
+    static std::size_t pool_min_frames(const ExtendibleHashOptions &options) {
+        return options.write_ahead_log && !options.read_only ? 2 * global_depth + 4 : 4;
+    }
+
+    /*
+     * Size of the blocks of a hash file built with or without direct I/O.
+     * With direct I/O a block is a whole number of O_DIRECT blocks, packed with as many buckets as fit (see `next_bucket_ref`),
+     * so writing a bucket never reads the rest of a block first and space is not padded bucket by bucket.
+     * Without direct I/O a block is a single bucket, so buckets are contiguous.
+     */
+    static long hash_block_size(bool direct) {
+        long size = sizeof(Bucket<KeyType>);
+        if (direct) {
+            size = (size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        }
+        return size;
+    }
+
+    /*
+     * Returns the position of the bucket that follows the one at position bucket_ref: the next slot of its block, or the start of the next block
+     * (buckets never cross a block, and the tail of a block that cannot fit one more is left unused).
+     */
+    long next_bucket_ref(long bucket_ref) const {
+        if (block_size / (long) sizeof(Bucket<KeyType>) == 1) {
+            return bucket_ref + block_size;
+        }
+        long next_ref = bucket_ref + (long) sizeof(Bucket<KeyType>);
+        if (next_ref % block_size + (long) sizeof(Bucket<KeyType>) > block_size) {
+            next_ref += block_size - next_ref % block_size;
+        }
+        return next_ref;
+    }
 
     /*
      * Returns a binary sequence of the hash key.
@@ -308,247 +747,1509 @@ class ExtendibleHashFile {
     }
 
     /*
-     * Auxiliary method for ensuring primary key consistency.
-     * Assumes necessary files are already open.
-     * Finds if a given key already exists on the index.
-     * Returns true if the key is found, and false otherwise.
-     * Accesses to disk: O(k)
+     * Opens the hash file if it is not already open.
+     * It stays open for the lifetime of the object, since the buffer pool may need to write back dirty buckets at any time.
      */
-    bool _find_if_exists(KeyType key) {
-        std::string hash_sequence = get_hash_sequence(key);
-        auto [entry_index, bucket_ref] = hash_index->lookup(hash_sequence);
-        // Read bucket at position bucket_ref
-        SEEK_ALL(hash_file, bucket_ref)
-        Bucket<KeyType> bucket{};
-        hash_file.read((char *) &bucket, sizeof(bucket));
-        // Search in chain of buckets
-        while (true) {
-            for (int i = 0; i < bucket.size; ++i) {
-                if (equal(key, bucket.records[i].key)) {
-                    return true;
-                }
-            }
-            // If there is a next bucket, explore it
-            if (bucket.next != -1) {
-                SEEK_ALL(hash_file, bucket.next)
-                hash_file.read((char *) &bucket, sizeof(bucket));
+    void open_hash_file() {
+        if (!hash_file.is_open()) {
+            if (options.read_only) {
+                hash_file.open(hash_file_name, O_RDONLY);
+                hash_file.map();
             } else {
-                break;
+                hash_file.open(hash_file_name, O_RDWR | O_CREAT, options.direct_io);
+            }
+            // Buckets are accessed by position: readahead would only evict useful pages
+            hash_file.advise(AccessPattern::Random);
+            // The blocks of the hash file are those it was built with (recorded in the mark file), whether it is opened with direct I/O or not,
+            // since buckets are found by position (a hash file built before blocks were recorded has contiguous buckets)
+            if (block_size == 0) {
+                block_size = hash_file.size() == 0 ? hash_block_size(hash_file.is_direct()) : (long) sizeof(Bucket<KeyType>);
             }
+            bucket_pool.set_block_size(block_size);
+            hash_file_end = hash_file_reserved = (hash_file.size() + block_size - 1) / block_size * block_size;
         }
-        return false;
     }
 
-
     /*
-     * Insertion algorithm.
-     * Auxiliary method that avoids excessive file opening and closing when inserting.
-     * Assumes necessary files are already open.
-     * When overflow happens, a new bucket is pushed to the front of the overflow chain and linked, to allow for more efficient insertions.
-     * Throws an exception if the key of the record to be inserted is already present and the index is for a primary key.
-     * Accesses to disk: O(k + global_depth) where k is the number of buckets in an overflow chain,
-     * and global_depth is the maximum depth of the index (number of bits in the binary sequences).
+     * Opens the raw data file if it is not already open.
      */
-    void _insert(RecordType &record, const long &record_ref) {
-        // If the attribute is a primary key, we must check whether a record with the given key already exists
-        if (primary_key && _find_if_exists(index(record))) {
-            throw std::runtime_error("Cannot insert a duplicate primary key.");
+    void open_raw_file() {
+        if (!raw_file.is_open()) {
+            if (options.read_only) {
+                raw_file.open(raw_file_name, O_RDONLY);
+                raw_file.map();
+            } else {
+                raw_file.open(raw_file_name, O_RDWR, options.direct_io);
+            }
+            // Searches read records by position (scans switch to sequential while they run)
+            raw_file.advise(AccessPattern::Random);
         }
-        std::string hash_sequence = get_hash_sequence(index(record));
-        auto [entry_index, bucket_ref] = hash_index->lookup(hash_sequence);
-        // Insert record into bucket bucket_ref of the hash file
-        SEEK_ALL(hash_file, bucket_ref)
-        // Read and update bucket bucket_ref if it's not full
-        Bucket<KeyType> bucket{};
-        hash_file.read((char *) &bucket, sizeof(bucket));
-        if (bucket.size < MAX_RECORDS_PER_BUCKET) {
-            // Append record
-            bucket.records[bucket.size++] = BucketPair<KeyType>{index(record), record_ref};
-            // Write bucket bucket_ref
-            SEEK_ALL(hash_file, bucket_ref)
-            hash_file.write((char *) &bucket, sizeof(bucket));
-        } else {
-            // Create new buckets and split hash index if possible
-            Bucket<KeyType> bucket_0{};
-            Bucket<KeyType> bucket_1{};
-            SEEK_ALL_RELATIVE(hash_file, 0, std::ios::end)
-            // Split the current hash entry and save a pointer to the end of the file (new bucket position)
-            auto [could_split, local_depth] = hash_index->split_entry(entry_index, TELL(hash_file));
-            // Split was successful, rehash the current content of the bucket into the two new buckets
-            if (could_split) {
-                for (int i = 0; i < bucket.size; ++i) {
-                    std::string ith_hash_seq = get_hash_sequence(bucket.records[i].key);
-                    if (ith_hash_seq[global_depth - 1 - local_depth] == '0') {
-                        bucket_0.records[bucket_0.size++] = bucket.records[i];
-                    } else {
-                        bucket_1.records[bucket_1.size++] = bucket.records[i];
-                    }
-                }
-                if (bucket_0.size != MAX_RECORDS_PER_BUCKET && bucket_1.size != MAX_RECORDS_PER_BUCKET) {
-                    // Insert the new record
-                    if (hash_sequence[global_depth - 1 - local_depth] == '0') {
-                        bucket_0.records[bucket_0.size++] = BucketPair<KeyType>{index(record), record_ref};
-                    } else {
-                        bucket_1.records[bucket_1.size++] = BucketPair<KeyType>{index(record), record_ref};
-                    }
-                    // Write the two new buckets to secondary storage
-                    SEEK_ALL(hash_file, bucket_ref)
-                    hash_file.write((char *) &bucket_0, sizeof(bucket_0));
-                    SEEK_ALL_RELATIVE(hash_file, 0, std::ios::end)
-                    hash_file.write((char *) &bucket_1, sizeof(bucket_1));
-                } else {
-                    // Write the two new buckets to secondary storage
-                    SEEK_ALL(hash_file, bucket_ref)
-                    hash_file.write((char *) &bucket_0, sizeof(bucket_0));
-                    SEEK_ALL_RELATIVE(hash_file, 0, std::ios::end)
-                    hash_file.write((char *) &bucket_1, sizeof(bucket_1));
-                    // Insert new record recursively (could not insert it in the current split)
-                    _insert(record, record_ref);
-                    return;
-                }
+    }
+
+    /*
+     * Reads the raw data file sequentially from position `start` (the whole file by default), calling `consume(record, record_ref)` for every record.
+     * The file is read in chunks of SCAN_CHUNK_SIZE bytes into two reusable buffers, and the records are consumed in place:
+     * while the records of one chunk are consumed, the next chunk is read by another thread.
+     * The scan runs with sequential readahead, and every SCAN_CACHE_WINDOW bytes it drops from the page cache the pages it brought in,
+     * so a one-shot scan does not evict the working set of searches (pages that were already cached are kept, see ScanCache).
+     */
+    template<typename Consumer>
+    void scan_raw_file(Consumer consume, long start = 0) {
+        open_raw_file();
+        raw_file.advise(AccessPattern::Sequential);
+        std::size_t chunk_records = std::max<std::size_t>(1, SCAN_CHUNK_SIZE / sizeof(RecordType));
+        std::vector<RecordType> chunks[2] = {std::vector<RecordType>(chunk_records), std::vector<RecordType>(chunk_records)};
+        ScanCache<File> scan_cache(raw_file, start);
+        // Only the reading thread accesses the raw data file until the scan is over (the reads are never concurrent)
+        auto read_chunk = [&](std::vector<RecordType> &chunk, long offset) {
+            scan_cache.before_read(offset + (long) (chunk.size() * sizeof(RecordType)));
+            std::size_t records = raw_file.read((char *) chunk.data(), chunk.size() * sizeof(RecordType), offset) / sizeof(RecordType);
+            scan_cache.after_read(offset + (long) (records * sizeof(RecordType)));
+            return records;
+        };
+        long record_ref = start;
+        std::size_t current = 0;
+        std::future<std::size_t> reading = std::async(std::launch::async, read_chunk, std::ref(chunks[current]), record_ref);
+        while (std::size_t records = reading.get()) {
+            long next_ref = record_ref + (long) (records * sizeof(RecordType));
+            if (records == chunk_records) {
+                reading = std::async(std::launch::async, read_chunk, std::ref(chunks[1 - current]), next_ref);
             }
-            // Split was unsuccessful. Create a new bucket.
-            else {
-                // Create new bucket
-                SEEK_ALL_RELATIVE(hash_file, 0, std::ios::end)
-                bucket_0.records[bucket_0.size++] = BucketPair<KeyType>{index(record), record_ref};
-                // Reference the parent (push front)
-                bucket_0.next = bucket_ref;
-                long new_bucket_ref = TELL(hash_file);
-                hash_file.write((char *) &bucket_0, sizeof(bucket_0));
-                // Put reference to the new bucket in the directory
-                hash_index->update_entry_bucket(entry_index, new_bucket_ref);
+            for (std::size_t i = 0; i < records; ++i) {
+                consume(chunks[current][i], record_ref + (long) (i * sizeof(RecordType)));
             }
+            if (records < chunk_records) {
+                break;
+            }
+            record_ref = next_ref;
+            current = 1 - current;
         }
+        scan_cache.finish();
+        raw_file.advise(AccessPattern::Random);
     }
 
-public:
-    explicit ExtendibleHashFile(const std::string &fileName, const std::string &uniqueId, bool primaryKey, Index index, Equal equal = std::equal_to<KeyType>{}, Hash hash = std::hash<KeyType>{}) : raw_file_name(fileName), primary_key(primaryKey), unique_id(uniqueId), index(index), equal(equal), hash_function(hash) {
-        hash_file_name = raw_file_name + "_" + unique_id + ".ehash";
-        index_file_name = raw_file_name + "_" + unique_id + ".ehashdir";
-        SAFE_FILE_CREATE_IF_NOT_EXISTS(index_file, index_file_name)
-        SAFE_FILE_OPEN(index_file, index_file_name, flags)
-        if (index_file.peek() != std::ifstream::traits_type::eof()) {
-            hash_index = new ExtendibleHash<global_depth>{index_file};
+    /*
+     * Is `true` if keys with the given hash belong to the shard of the index (every key does, unless it's a shard).
+     */
+    bool owns(std::size_t hash) const {
+        return func::shard_of(hash, options.shard_bits) == options.shard;
+    }
+
+    void check_writable() {
+        if (options.read_only) {
+            throw std::runtime_error("Cannot modify an index opened in read-only mode.");
         }
-        index_file.close();
     }
 
+    /*
+     * Is `true` if the durability level of the index requires syncing on the given event.
+     */
+    bool requires_sync(Durability event) const {
+        return options.durability >= event;
+    }
 
     /*
-     * Returns a bool that indicates whether the index has already been created.
+     * Forces the log to stable storage before a logged change is written in place (skipped with Durability::None).
      */
-    explicit operator bool() {
-        SAFE_FILE_OPEN(index_file, index_file_name, flags)
-        bool is_created = false;
-        if (index_file.peek() != std::ifstream::traits_type::eof()) {
-            is_created = true;
+    void sync_log() {
+        if (wal.is_open() && requires_sync(Durability::OnCheckpoint)) {
+            wal.sync();
         }
-        index_file.close();
-        return is_created;
     }
 
-
     /*
-     * Constructs the hash index file from a fixed length binary data file.
-     * It creates 2 files: The directory file (.ehashdir) and the hash index (.ehash).
-     * Accesses to disk: O(n) where n is the total number of records in the data file.
+     * Writes the modified buckets and then the modified directory entries, so the directory never references a bucket that is not on disk.
+     * With a write-ahead log, the log reaches stable storage first.
      */
-    void create_index() {
-        SAFE_FILE_CREATE_IF_NOT_EXISTS(hash_file, hash_file_name)
-        SAFE_FILE_OPEN(hash_file, hash_file_name, flags)
-        SAFE_FILE_OPEN(raw_file, raw_file_name, flags)
-        SAFE_FILE_OPEN(index_file, index_file_name, flags | std::ios::trunc)
-        SEEK_ALL(hash_file, 0)
-        SEEK_ALL(raw_file, 0)
-        SEEK_ALL(index_file, 0)
-        Bucket<KeyType> bucket_0{};
-        Bucket<KeyType> bucket_1{};
-        hash_index = new ExtendibleHash<global_depth>{sizeof(bucket_0)};
-        hash_file.write((char *) &bucket_0, sizeof(bucket_0));
-        hash_file.write((char *) &bucket_1, sizeof(bucket_1));
-        // Construct hash file (.ehash)
-        RecordType record{};
-        while (!raw_file.eof()) {
-            long record_ref = TELL(raw_file);
-            raw_file.read((char *) &record, sizeof(record));
-            if (!raw_file.eof()) {
-                if (!record.removed) {
-                    _insert(record, record_ref);
-                }
-            }
+    void write_back() {
+        sync_log();
+        if (hash_file.is_open()) {
+            bucket_pool.flush();
         }
-        hash_index->write_to_disk(index_file);
-        raw_file.close();
-        hash_file.close();
-        index_file.close();
+        if (hash_index != nullptr && hash_index->has_changes()) {
+            hash_index->write_changes(index_file);
+        }
+        write_mark();
     }
 
+    /*
+     * Writes the high-water mark if it was advanced. It's written after the buckets and the directory, so it never covers a record
+     * that is not indexed on disk (after a crash it may lag behind, and `catch_up` indexes those records again, see `catch_up`).
+     * The block size of the hash file is written with it.
+     */
+    void write_mark() {
+        if (indexed_end_changed) {
+            long mark[2] = {indexed_end, block_size};
+            mark_file.write((const char *) mark, sizeof(mark), 0);
+            indexed_end_changed = false;
+        }
+    }
 
     /*
-     * Searches a given key.
-     * Returns a vector of elements that match the given key.
-     * If the index was created for primary keys, it returns a single element.
-     * If no element matches the given key, it returns an empty vector.
-     * Accesses to disk: O(k) where k is the length of the bucket chain accessed
+     * Makes the operations applied so far durable if the durability level requires it on the given event.
+     * With a write-ahead log only the log is synced, otherwise the changes are written back and every modified file is synced.
      */
-    std::vector<RecordType> search(KeyType key) {
-        SAFE_FILE_OPEN(hash_file, hash_file_name, flags)
-        SAFE_FILE_OPEN(raw_file, raw_file_name, flags)
-        std::vector<RecordType> result;
+    void make_durable(Durability event) {
+        if (!requires_sync(event)) {
+            return;
+        }
+        if (options.write_ahead_log) {
+            wal.sync();
+        } else {
+            write_back();
+            sync_files();
+        }
+    }
+
+    /*
+     * Closes the open group (if any) once its changes have been written back, or once `error` made that impossible,
+     * and wakes up its inserts.
+     */
+    void finish_group(std::exception_ptr error = nullptr) {
+        pending_inserts = 0;
+        if (open_group != nullptr) {
+            open_group->committed = true;
+            open_group->error = error;
+            open_group = nullptr;
+            group_committed.notify_all();
+        }
+    }
+
+    /*
+     * Commits the open group: writes it back and, with Durability::PerBatch or higher, forces it to stable storage with one fdatasync per modified file.
+     * If the commit fails, the failure is also reported to every insert of the group.
+     * Accesses to disk: O(r) where r is the number of runs of adjacent modified buckets and directory entries
+     */
+    void commit_group() {
+        try {
+            if (!options.write_ahead_log) {
+                write_back();
+            }
+            make_durable(Durability::PerBatch);
+        } catch (...) {
+            finish_group(std::current_exception());
+            throw;
+        }
+        finish_group();
+    }
+
+    /*
+     * Syncs the files that were modified since they were last synced (see DiskFile::sync).
+     */
+    void sync_files() {
+        if (hash_file.is_open()) {
+            hash_file.sync();
+        }
+        index_file.sync();
+        if (raw_file.is_open()) {
+            raw_file.sync();
+        }
+        if (mark_file.is_open()) {
+            mark_file.sync();
+        }
+    }
+
+    /*
+     * Appends the after-images of the buckets and directory entries modified by the last operation to the log, as a single frame.
+     * The buckets were held in the buffer pool while the operation ran, so none of its changes reached the hash file before being logged.
+     */
+    void log_operation() {
+        for (long page_ref: bucket_pool.release_held_pages()) {
+            const Bucket<KeyType> &bucket = bucket_pool.pin(page_ref);
+            wal.add(LogTarget::HashFile, page_ref, (const char *) &bucket, sizeof(bucket));
+            bucket_pool.unpin(page_ref);
+        }
+        for (std::size_t entry_index: hash_index->take_operation_changes()) {
+            wal.add(LogTarget::Directory, (long) (entry_index * sizeof(ExtendibleHashEntry<global_depth>)), (const char *) &hash_index->entry(entry_index), sizeof(ExtendibleHashEntry<global_depth>));
+        }
+        wal.append();
+    }
+
+    /*
+     * Writes every logged change in place, forces the files to stable storage and empties the log.
+     * Accesses to disk: O(r) where r is the number of runs of adjacent modified buckets and directory entries
+     */
+    void checkpoint_log() {
+        write_back();
+        if (requires_sync(Durability::OnCheckpoint)) {
+            sync_files();
+        }
+        wal.reset();
+    }
+
+    /*
+     * Redoes the frames left in the log by a crash, so the files reflect every logged operation, and empties the log.
+     * Runs before the directory is loaded.
+     */
+    void recover() {
+        if (!wal.is_open()) {
+            if (!File::exists(wal_file_name)) {
+                return;
+            }
+            wal.open(wal_file_name);
+        }
+        if (wal.size() == 0) {
+            return;
+        }
+        if (options.read_only) {
+            throw std::runtime_error("Could not open index: its write-ahead log must be recovered in writable mode.");
+        }
+        open_hash_file();
+        open_raw_file();
+        wal.replay([&](LogTarget target, long offset, const char *data, std::size_t size) {
+            if (target == LogTarget::HashFile) {
+                hash_file.write(data, size, offset);
+            } else if (target == LogTarget::Directory) {
+                index_file.write(data, size, offset);
+            } else {
+                raw_file.write(data, size, offset);
+            }
+        });
+        hash_file_end = hash_file_reserved = (hash_file.size() + block_size - 1) / block_size * block_size;
+        sync_files();
+        wal.reset();
+    }
+
+    /*
+     * Body of the committer thread: waits for a group to start and commits it when its window expires
+     * (unless it was already committed because it reached group_commit_size).
+     * A failure is reported to the inserts of the group (see `commit_group`), or to the next `commit` if they do not wait for it.
+     */
+    void run_committer() {
+        std::unique_lock<std::mutex> lock(writer_latch);
+        while (!stopping) {
+            if (open_group == nullptr) {
+                group_started.wait(lock);
+            } else if (group_started.wait_until(lock, group_deadline) == std::cv_status::timeout && open_group != nullptr) {
+                try {
+                    commit_group();
+                } catch (...) {
+                    if (!requires_sync(Durability::PerBatch)) {
+                        commit_error = std::current_exception();
+                    }
+                }
+            }
+        }
+    }
+
+    void check_commit_error() {
+        if (commit_error) {
+            std::exception_ptr error = commit_error;
+            commit_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    /*
+     * Returns the bucket at position bucket_ref, which must be released with `release_bucket`.
+     * In read-only mode the bucket is accessed directly in the mapped hash file, otherwise it's pinned in the buffer pool.
+     */
+    const Bucket<KeyType> &acquire_bucket(long bucket_ref) {
+        if (options.read_only) {
+            return *(const Bucket<KeyType> *) hash_file.mapped(bucket_ref, sizeof(Bucket<KeyType>));
+        }
+        return bucket_pool.pin(bucket_ref);
+    }
+
+    void release_bucket(long bucket_ref) {
+        if (!options.read_only) {
+            bucket_pool.unpin(bucket_ref);
+        }
+    }
+
+    std::atomic<std::size_t> &bucket_version(long bucket_ref) {
+        return bucket_versions[(std::size_t) (bucket_ref / (long) sizeof(Bucket<KeyType>)) % BUCKET_VERSION_STRIPES];
+    }
+
+    /*
+     * Marks the start and the end of a change that searches must not observe halfway (the version is odd meanwhile).
+     * Changes are made by a single writer at a time (see writer_latch).
+     */
+    static void begin_change(std::atomic<std::size_t> &version) {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void end_change(std::atomic<std::size_t> &version) {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*
+     * Is `true` if the version is still `before` (even), i.e. no change overlapped the reads made since it was loaded.
+     */
+    static bool is_unchanged(const std::atomic<std::size_t> &version, std::size_t before) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return before % 2 == 0 && version.load(std::memory_order_relaxed) == before;
+    }
+
+    /*
+     * Copies the bucket at position bucket_ref without latching it: the copy is retried until no insert modified the bucket
+     * while it was being copied (its version did not change), so searches never write to memory shared with other searches.
+     * A bucket resident in the buffer pool is copied without taking the latch of the pool or pinning it (see BufferPool::read_resident),
+     * so only a miss takes the latch.
+     */
+    void read_bucket(long bucket_ref, Bucket<KeyType> &copy) {
+        static_assert(sizeof(Bucket<KeyType>) % sizeof(long) == 0, "Buckets are copied a word at a time.");
+        if (!options.read_only && bucket_pool.read_resident(bucket_ref, [&](const Bucket<KeyType> &bucket) { copy_bucket(bucket_ref, bucket, copy); })) {
+            return;
+        }
+        const Bucket<KeyType> &bucket = acquire_bucket(bucket_ref);
+        copy_bucket(bucket_ref, bucket, copy);
+        release_bucket(bucket_ref);
+    }
+
+    void copy_bucket(long bucket_ref, const Bucket<KeyType> &bucket, Bucket<KeyType> &copy) {
+        std::atomic<std::size_t> &version = bucket_version(bucket_ref);
+        while (true) {
+            std::size_t before = version.load(std::memory_order_acquire);
+            if (before % 2 == 0) {
+                func::atomic_copy(&copy, &bucket, sizeof(copy));
+                if (is_unchanged(version, before)) {
+                    break;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /*
+     * Runs `read()`, which looks up the directory and follows bucket chains (see `read_bucket`) without latching them, until no split and
+     * no new overflow bucket overlapped it (the directory version did not change). `read()` returns `false` if it could not complete
+     * (an entry was not found while the directory was being split). After OPTIMISTIC_READ_RETRIES attempts, inserts are held off while it runs.
+     */
+    template<typename Read>
+    void read_chains(Read read) {
+        for (std::size_t attempt = 0; attempt < OPTIMISTIC_READ_RETRIES; ++attempt) {
+            std::size_t before = directory_version.load(std::memory_order_acquire);
+            if (before % 2 == 0 && read() && is_unchanged(directory_version, before)) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        std::lock_guard<std::mutex> writer_lock(writer_latch);
+        if (!read()) {
+            throw std::runtime_error("Could not find given hash sequence on ExtendibleHash.");
+        }
+    }
+
+    /*
+     * Groups the keys at the given positions by the first bucket of their chain. Returns `false` if an entry was not found
+     * while the directory was being split (see `read_chains`).
+     */
+    bool group_chains(const std::vector<std::size_t> &positions, const std::vector<std::string> &hash_sequences, std::vector<ChainGroup> &groups) {
+        groups.clear();
+        // Pairs (bucket_ref, key position), sorted so that the keys of the same chain are adjacent
+        std::vector<std::pair<long, std::size_t>> chains;
+        for (std::size_t position: positions) {
+            auto [entry_index, bucket_ref] = hash_index->find(hash_sequences[position]);
+            if (entry_index == (std::size_t) -1) {
+                return false;
+            }
+            chains.emplace_back(bucket_ref, position);
+        }
+        std::sort(chains.begin(), chains.end());
+        for (auto &[bucket_ref, position]: chains) {
+            if (groups.empty() || groups.back().bucket_ref != bucket_ref) {
+                groups.push_back(ChainGroup{bucket_ref, {}});
+            }
+            groups.back().keys.push_back(position);
+        }
+        return true;
+    }
+
+    /*
+     * Follows the chains of the groups level by level, and appends the pairs (key position, record_ref) of the matching records to `matches`.
+     * All the buckets of a level that are not cached are read in a single batch, and every bucket is read once for all the keys of its group.
+     * With a primary key, a key leaves its group once found, and a chain is followed until every key of its group is found.
+     */
+    void follow_chains(std::vector<ChainGroup> groups, KeyType *keys, std::vector<std::pair<std::size_t, long>> &matches) {
+        Bucket<KeyType> bucket;
+        while (!groups.empty()) {
+            // Read every bucket of this level that is not cached in one batch
+            if (!options.read_only) {
+                std::vector<long> bucket_refs;
+                for (auto &group: groups) {
+                    bucket_refs.push_back(group.bucket_ref);
+                }
+                bucket_pool.prefetch(bucket_refs);
+            }
+            // Search the buckets of this level
+            std::vector<ChainGroup> next_groups;
+            for (auto &group: groups) {
+                read_bucket(group.bucket_ref, bucket);
+                std::vector<std::size_t> remaining;
+                for (std::size_t key_index: group.keys) {
+                    bool found = false;
+                    for (int i = 0; i < bucket.size; ++i) {
+                        if (equal(keys[key_index], (KeyType &) bucket.records[i].key)) {
+                            matches.emplace_back(key_index, bucket.records[i].record_ref);
+                            found = true;
+                            // If primary key, stop searching
+                            if (primary_key) {
+                                break;
+                            }
+                        }
+                    }
+                    if (!found || !primary_key) {
+                        remaining.push_back(key_index);
+                    }
+                }
+                // If there is a next bucket, explore it in the next level
+                if (!remaining.empty() && bucket.next != -1) {
+                    next_groups.push_back(ChainGroup{bucket.next, std::move(remaining)});
+                }
+            }
+            groups.swap(next_groups);
+        }
+    }
+
+    /*
+     * Runs `work(worker)` for every worker from 0 to `workers` - 1: worker 0 in the calling thread and the rest in the search pool.
+     * Waits for every worker, and then throws the first exception raised, if any.
+     */
+    template<typename Work>
+    void run_search_workers(std::size_t workers, Work work) {
+        std::vector<std::future<void>> running;
+        for (std::size_t worker = 1; worker < workers; ++worker) {
+            running.push_back(search_pool->submit([&work, worker] {
+                work(worker);
+            }));
+        }
+        std::exception_ptr error;
+        try {
+            work(0);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        for (auto &worker: running) {
+            try {
+                worker.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    /*
+     * Throws an exception if the index has not been created, since it cannot be searched or modified.
+     */
+    void check_created() {
+        if (hash_index == nullptr) {
+            throw std::runtime_error("Cannot access an index that has not been created.");
+        }
+    }
+
+    /*
+     * Fetches the matching records given as pairs (result position, record_ref) and appends the ones not removed to `result`.
+     * Records found in the record cache are not read again. The rest are fetched in the order they appear in the raw data file,
+     * merging nearby records into a single read (see DiskFile::read_coalesced), and then cached unless they were invalidated meanwhile.
+     * In read-only mode the records are accessed directly in the mapped raw file.
+     */
+    void fetch_records(std::vector<std::pair<std::size_t, long>> &matches, std::vector<std::vector<RecordType>> &result) {
+        std::sort(matches.begin(), matches.end(), [](const std::pair<std::size_t, long> &a, const std::pair<std::size_t, long> &b) {
+            return a.second < b.second;
+        });
+        if (options.read_only) {
+            for (auto &[position, record_ref]: matches) {
+                auto &record = *(const RecordType *) raw_file.mapped(record_ref, sizeof(RecordType));
+                if (!record.removed) {
+                    result[position].push_back(record);
+                }
+            }
+            return;
+        }
+        std::vector<RecordType> records(matches.size());
+        std::vector<IoRequest> requests;
+        std::vector<std::size_t> missed;
+        // Generations of the cache taken before the reads, so a record removed meanwhile through another index is not cached
+        std::vector<std::size_t> generations;
+        for (std::size_t i = 0; i < matches.size(); ++i) {
+            if (!record_cache->get(matches[i].second, records[i])) {
+                requests.push_back(IoRequest{(char *) &records[i], sizeof(RecordType), matches[i].second});
+                missed.push_back(i);
+                generations.push_back(record_cache->generation(matches[i].second));
+            }
+        }
+        if (!requests.empty()) {
+            raw_file.read_coalesced(requests, RECORD_COALESCE_GAP);
+        }
+        for (std::size_t j = 0; j < requests.size(); ++j) {
+            if (requests[j].done != requests[j].size) {
+                throw std::runtime_error("Could not read record from raw data file.");
+            }
+            record_cache->put(matches[missed[j]].second, records[missed[j]], generations[j]);
+        }
+        for (std::size_t i = 0; i < matches.size(); ++i) {
+            if (!records[i].removed) {
+                result[matches[i].first].push_back(records[i]);
+            }
+        }
+    }
+
+    /*
+     * Reserves space for a new bucket at the end of the hash file.
+     * The bucket itself reaches the disk when the buffer pool writes it back.
+     * Disk space is reserved a whole extent at a time, so the file does not fragment as it grows.
+     */
+    long allocate_bucket() {
+        long bucket_ref = hash_file_end;
+        hash_file_end = next_bucket_ref(bucket_ref);
+        if (hash_file_end > hash_file_reserved) {
+            long extent = std::max<long>(HASH_FILE_EXTENT_SIZE, block_size);
+            hash_file.preallocate(bucket_ref, extent);
+            hash_file_reserved = bucket_ref + extent;
+        }
+        return bucket_ref;
+    }
+
+    /*
+     * Reverses the lowest global_depth bits of a hash.
+     * Buckets split on the lowest bits first, so sorting pairs by this value leaves the pairs of every bucket contiguous, at any depth.
+     */
+    static std::size_t bucket_order(std::size_t hash) {
+        std::size_t order = 0;
+        for (std::size_t bit = 0; bit < global_depth; ++bit) {
+            order = (order << 1) | ((hash >> bit) & 1);
+        }
+        return order;
+    }
+
+    /*
+     * Is `true` if there are more than `position` pairs left and the one at `position` has the given lowest `depth` bits of the hash.
+     */
+    bool next_pair_has_prefix(BuildState &state, std::size_t position, std::size_t depth, std::size_t prefix) {
+        BuildPair build_pair;
+        while (state.lookahead.size() <= position && state.pairs->next(build_pair)) {
+            state.lookahead.push_back(build_pair);
+        }
+        if (state.lookahead.size() <= position) {
+            return false;
+        }
+        return (state.lookahead[position].hash & (((std::size_t) 1 << depth) - 1)) == prefix;
+    }
+
+    /*
+     * Takes the next pair to be placed in a bucket.
+     * Throws an exception if the index is for a primary key and another pair has the same key (pairs with the same key have the same hash, so they are adjacent).
+     */
+    BucketPair<KeyType> take_pair(BuildState &state) {
+        BuildPair build_pair = state.lookahead.front();
+        state.lookahead.pop_front();
+        --state.remaining;
+        if (primary_key) {
+            if (!state.same_hash.empty() && state.same_hash.front().hash != build_pair.hash) {
+                state.same_hash.clear();
+            }
+            for (auto &other: state.same_hash) {
+                if (equal(other.pair.key, build_pair.pair.key)) {
+                    throw std::runtime_error("Cannot insert a duplicate primary key.");
+                }
+            }
+            state.same_hash.push_back(build_pair);
+        }
+        return build_pair.pair;
+    }
+
+    /*
+     * Claims a region at the end of the hash file for the next buckets of a build, reserving its disk space.
+     * Regions hold up to HASH_FILE_EXTENT_SIZE bytes of buckets, but not many more than the pairs left need,
+     * so the threads of a parallel build, which claim their own regions, leave little unused space between them.
+     */
+    void claim_region(BuildState &state) {
+        std::size_t block_buckets = block_size / sizeof(Bucket<KeyType>);
+        std::size_t extent_blocks = std::max<std::size_t>(1, HASH_FILE_EXTENT_SIZE / block_size);
+        std::size_t region_blocks = std::min(extent_blocks, (state.remaining / MAX_RECORDS_PER_BUCKET + 16 + block_buckets - 1) / block_buckets);
+        long region_size = (long) region_blocks * block_size;
+        std::lock_guard<std::mutex> lock(build_latch);
+        state.written_ref = state.next_ref = hash_file_reserved;
+        hash_file.preallocate(hash_file_reserved, region_size);
+        hash_file_reserved += region_size;
+        state.region_end = hash_file_reserved;
+    }
+
+    /*
+     * Places a built bucket in the region claimed by the build, claiming a new one if it is full.
+     * The buckets of a region are written together once it is full. Returns the position of the bucket.
+     */
+    long place_bucket(BuildState &state, const Bucket<KeyType> &bucket) {
+        if (state.next_ref == state.region_end) {
+            write_built_buckets(state);
+            claim_region(state);
+        }
+        long bucket_ref = state.next_ref;
+        state.next_ref = next_bucket_ref(bucket_ref);
+        state.buckets.push_back(bucket);
+        return bucket_ref;
+    }
+
+    /*
+     * Writes the buckets placed but not written yet (which are adjacent) to the hash file with a single sequential write of whole blocks
+     * (the unused tail of every block, and of the last one written, padded with zeros).
+     */
+    void write_built_buckets(BuildState &state) {
+        if (state.buckets.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(build_latch);
+        if (block_size == (long) sizeof(Bucket<KeyType>)) {
+            hash_file.write((char *) state.buckets.data(), state.buckets.size() * sizeof(Bucket<KeyType>), state.written_ref);
+            state.written_ref += (long) (state.buckets.size() * sizeof(Bucket<KeyType>));
+        } else {
+            static const char padding[DIRECT_IO_ALIGNMENT] = {};
+            std::vector<iovec> vectors;
+            long start = state.written_ref;
+            for (std::size_t i = 0; i < state.buckets.size(); ++i) {
+                long bucket_end = state.written_ref + (long) sizeof(Bucket<KeyType>);
+                state.written_ref = next_bucket_ref(state.written_ref);
+                if (i + 1 == state.buckets.size()) {
+                    state.written_ref = (state.written_ref + block_size - 1) / block_size * block_size;
+                }
+                vectors.push_back(iovec{&state.buckets[i], sizeof(Bucket<KeyType>)});
+                if (state.written_ref > bucket_end) {
+                    vectors.push_back(iovec{(void *) padding, (std::size_t) (state.written_ref - bucket_end)});
+                }
+            }
+            hash_file.write_vectored(vectors.data(), (int) vectors.size(), start);
+        }
+        hash_file_end = std::max(hash_file_end, state.written_ref);
+        state.buckets.clear();
+    }
+
+    /*
+     * Builds the buckets and directory entries of the next pairs whose hashes share their lowest `depth` bits (`prefix`).
+     * The pairs become a single bucket once they fit in one (at depth 1 or more), which is found by looking at most
+     * MAX_RECORDS_PER_BUCKET + 1 pairs ahead. Otherwise they are split on the next bit, as an insert would,
+     * unless the depth is already global_depth: then they become an overflow chain, built as inserts would push it
+     * (the last bucket placed is the first of the chain, and the only one that may not be full).
+     * Pairs are consumed in order, so the whole set of pairs never needs to be in memory.
+     */
+    void build_buckets(BuildState &state, std::size_t depth, std::size_t prefix) {
+        std::size_t count = 0;
+        while (count <= (std::size_t) MAX_RECORDS_PER_BUCKET && next_pair_has_prefix(state, count, depth, prefix)) {
+            ++count;
+        }
+        if ((depth > 0 && count <= (std::size_t) MAX_RECORDS_PER_BUCKET) || depth == global_depth) {
+            Bucket<KeyType> bucket{};
+            while (next_pair_has_prefix(state, 0, depth, prefix)) {
+                if (bucket.size == MAX_RECORDS_PER_BUCKET) {
+                    long bucket_ref = place_bucket(state, bucket);
+                    bucket = Bucket<KeyType>{};
+                    bucket.next = bucket_ref;
+                }
+                bucket.records[bucket.size++] = take_pair(state);
+            }
+            ExtendibleHashEntry<global_depth> entry{};
+            entry.local_depth = depth;
+            std::strcpy(entry.sequence, std::bitset<global_depth>(prefix).to_string().c_str());
+            entry.bucket_ref = place_bucket(state, bucket);
+            state.entries.push_back(entry);
+            return;
+        }
+        build_buckets(state, depth + 1, prefix);
+        build_buckets(state, depth + 1, prefix | ((std::size_t) 1 << depth));
+    }
+
+    /*
+     * Estimates the amount of distinct keys in the raw data file (of the shard of the index), with a HyperLogLog sketch of the keys
+     * of BUILD_SAMPLE_RECORDS records read in a few runs spread over the file. A sample may underestimate it, which only makes a build use fewer partitions.
+     * Accesses to disk: O(1)
+     */
+    std::size_t estimate_distinct_keys(std::size_t records) {
+        const std::size_t runs = 16;
+        std::size_t run_records = std::max<std::size_t>(1, std::min<std::size_t>(records, BUILD_SAMPLE_RECORDS) / runs);
+        std::vector<RecordType> run(run_records);
+        HyperLogLog sketch;
+        for (std::size_t i = 0; i < runs && run_records <= records; ++i) {
+            long offset = (long) ((records - run_records) * i / (runs - 1) * sizeof(RecordType));
+            std::size_t read = raw_file.read((char *) run.data(), run_records * sizeof(RecordType), offset) / sizeof(RecordType);
+            for (std::size_t j = 0; j < read; ++j) {
+                std::size_t hash = hash_function(index(run[j]));
+                if (!run[j].removed && owns(hash)) {
+                    sketch.add(hash);
+                }
+            }
+        }
+        return (std::size_t) sketch.estimate();
+    }
+
+    /*
+     * Amount of lowest bits of the hash that split a build in partitions, built by different threads (0 builds on the calling thread).
+     * There are at least as many partitions as build_threads, as long as each one is expected to get BUILD_PARTITION_MIN_RECORDS records
+     * and BUILD_PARTITION_MIN_KEYS distinct keys (estimated from a sample, see `estimate_distinct_keys`): keys with few distinct values
+     * would leave most partitions empty, and split the memory of the build among them for nothing.
+     * `expected_records` is the amount of records the build will get if the raw data file is still being written (see `create_index`):
+     * the keys are then sampled from the records written so far.
+     */
+    std::size_t build_partition_bits(std::size_t expected_records) {
+        std::size_t file_records = raw_file.size() / sizeof(RecordType);
+        // A shard only gets its share of the records
+        std::size_t records = std::max(file_records, expected_records) >> options.shard_bits;
+        if (options.build_threads <= 1 || (records >> 1) < BUILD_PARTITION_MIN_RECORDS) {
+            return 0;
+        }
+        std::size_t keys = estimate_distinct_keys(file_records);
+        std::size_t bits = 0;
+        while (bits < global_depth && ((std::size_t) 1 << bits) < options.build_threads && (records >> (bits + 1)) >= BUILD_PARTITION_MIN_RECORDS && (keys >> (bits + 1)) >= BUILD_PARTITION_MIN_KEYS) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    /*
+     * Routes the pairs of a batch of records to their partitions (by the lowest `partition_bits` bits of the hash), skipping the keys of other shards.
+     * Runs on the threads of a parallel build.
+     */
+    void add_build_pairs(std::vector<std::pair<RecordType, long>> &records, std::vector<std::unique_ptr<BuildPartition>> &partitions, std::size_t partition_bits) {
+        std::vector<std::vector<BuildPair>> routed(partitions.size());
+        for (auto &[record, record_ref]: records) {
+            std::size_t hash = hash_function(index(record));
+            if (!owns(hash)) {
+                continue;
+            }
+            routed[hash & (((std::size_t) 1 << partition_bits) - 1)].push_back(BuildPair{bucket_order(hash), hash, BucketPair<KeyType>{index(record), record_ref}});
+        }
+        for (std::size_t i = 0; i < partitions.size(); ++i) {
+            if (!routed[i].empty()) {
+                std::lock_guard<std::mutex> lock(partitions[i]->mutex);
+                for (auto &build_pair: routed[i]) {
+                    partitions[i]->pairs.add(build_pair);
+                }
+            }
+        }
+    }
+
+    /*
+     * Splits the top of the trie, above the partitions (depth < partition_bits), in parts built by a single thread.
+     * A node whose partitions hold few enough pairs for a single bucket becomes a part, as it would in a serial build,
+     * and so does every partition whose pairs need more than a bucket.
+     */
+    void plan_build_parts(std::vector<std::unique_ptr<BuildPartition>> &partitions, std::size_t partition_bits, std::size_t depth, std::size_t prefix, std::vector<BuildPart> &parts) {
+        std::size_t count = 0;
+        std::vector<std::size_t> covered;
+        for (std::size_t i = 0; i < partitions.size(); ++i) {
+            // Visited in the order of their pairs (see `bucket_order`)
+            std::size_t partition = bucket_order(i) >> (global_depth - partition_bits);
+            if ((partition & (((std::size_t) 1 << depth) - 1)) == prefix) {
+                count += partitions[partition]->pairs.size();
+                covered.push_back(partition);
+            }
+        }
+        if ((depth > 0 && count <= (std::size_t) MAX_RECORDS_PER_BUCKET) || depth == partition_bits) {
+            BuildPart &part = parts.emplace_back();
+            part.depth = depth;
+            part.prefix = prefix;
+            part.partitions = covered;
+            return;
+        }
+        plan_build_parts(partitions, partition_bits, depth + 1, prefix, parts);
+        plan_build_parts(partitions, partition_bits, depth + 1, prefix | ((std::size_t) 1 << depth), parts);
+    }
+
+    /*
+     * Builds the buckets and directory entries of a whole partition. Returns the entries.
+     */
+    std::vector<ExtendibleHashEntry<global_depth>> build_partition(BuildPartition &partition, std::size_t depth, std::size_t prefix) {
+        partition.pairs.finish();
+        BuildState state(&partition.pairs);
+        build_buckets(state, depth, prefix);
+        write_built_buckets(state);
+        return std::move(state.entries);
+    }
+
+    /*
+     * Builds the whole hash file and directory from the pairs of every record, replacing the current ones.
+     * The pairs of every partition are sorted by bucket, so every bucket is written exactly once, sequentially (in regions, see `claim_region`),
+     * and the directory with a single write. With a thread pool, the partitions are built in parallel.
+     * Accesses to disk: O(b) sequential writes where b is the number of buckets
+     */
+    void bulk_load(std::vector<std::unique_ptr<BuildPartition>> &partitions, std::size_t partition_bits, ThreadPool *pool) {
+        hash_file.truncate(0);
+        hash_file_end = hash_file_reserved = 0;
+        // A hash file built from scratch takes the blocks of the mode it is open in (recorded with the high-water mark)
+        block_size = hash_block_size(hash_file.is_direct());
+        bucket_pool.set_block_size(block_size);
+        std::vector<BuildPart> parts;
+        plan_build_parts(partitions, partition_bits, 0, 0, parts);
+        // Parts made of several partitions are small (a single bucket): they share a state and are built on this thread
+        BuildState shared_state;
+        std::exception_ptr error;
+        for (auto &part: parts) {
+            if (part.depth == partition_bits) {
+                BuildPartition &partition = *partitions[part.partitions.front()];
+                if (pool != nullptr) {
+                    part.built = pool->submit([this, &partition, &part] {
+                        return build_partition(partition, part.depth, part.prefix);
+                    });
+                } else {
+                    part.entries = build_partition(partition, part.depth, part.prefix);
+                }
+                continue;
+            }
+            try {
+                ExternalSorter<BuildPair, BuildOrder> pairs{hash_file_name, options.build_memory_size};
+                for (std::size_t partition: part.partitions) {
+                    partitions[partition]->pairs.finish();
+                    BuildPair build_pair;
+                    while (partitions[partition]->pairs.next(build_pair)) {
+                        pairs.add(build_pair);
+                    }
+                }
+                pairs.finish();
+                shared_state.pairs = &pairs;
+                shared_state.remaining = pairs.size();
+                build_buckets(shared_state, part.depth, part.prefix);
+                part.entries.swap(shared_state.entries);
+            } catch (...) {
+                error = std::current_exception();
+                break;
+            }
+        }
+        if (!error) {
+            try {
+                write_built_buckets(shared_state);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        // Every part built by another thread must finish before returning, even after a failure
+        std::vector<ExtendibleHashEntry<global_depth>> entries;
+        for (auto &part: parts) {
+            if (part.built.valid()) {
+                try {
+                    part.entries = part.built.get();
+                } catch (...) {
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+            entries.insert(entries.end(), part.entries.begin(), part.entries.end());
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        delete hash_index;
+        hash_index = new ExtendibleHash<global_depth>{std::move(entries)};
+        hash_index->write_to_disk(index_file);
+    }
+
+    /*
+     * Rebuilds the index from the records produced by `scan(consume)` (see `create_index`).
+     * With several build_threads and enough records, the keys are hashed by a thread pool in batches and routed to partitions
+     * (by the lowest bits of their hash), which are then sorted and built in parallel (see `bulk_load`).
+     * `expected_records` is the amount of records `scan` produces, if the raw data file does not hold them all yet (0 otherwise).
+     */
+    template<typename Scan>
+    void build_index(Scan scan, std::size_t expected_records = 0) {
+        check_writable();
+        open_hash_file();
+        open_raw_file();
+        // Start from an empty hash file (and log: the index is rebuilt from the raw data file)
+        if (wal.is_open()) {
+            wal.reset();
+        }
+        bucket_pool.discard();
+        record_cache->clear();
+        // Collect the key of every record in a single sequential scan, sort them by bucket and then build every bucket at once
+        std::size_t partition_bits = build_partition_bits(expected_records);
+        std::vector<std::unique_ptr<BuildPartition>> partitions;
+        for (std::size_t i = 0; i < ((std::size_t) 1 << partition_bits); ++i) {
+            partitions.push_back(std::make_unique<BuildPartition>(hash_file_name + "." + std::to_string(i), options.build_memory_size >> partition_bits));
+        }
+        // End of the last record produced by the scan (the new high-water mark)
+        long scanned_end = 0;
+        if (partition_bits == 0) {
+            scan([&](RecordType &record, long record_ref) {
+                scanned_end = record_ref + (long) sizeof(RecordType);
+                if (!record.removed) {
+                    std::size_t hash = hash_function(index(record));
+                    if (owns(hash)) {
+                        partitions[0]->pairs.add(BuildPair{bucket_order(hash), hash, BucketPair<KeyType>{index(record), record_ref}});
+                    }
+                }
+            });
+            bulk_load(partitions, 0, nullptr);
+        } else {
+            // Declared after the partitions, so its threads stop before the partitions are destroyed
+            ThreadPool pool(options.build_threads);
+            std::size_t batch_size = std::max<std::size_t>(1, BUILD_BATCH_SIZE / sizeof(RecordType));
+            auto batch = std::make_shared<std::vector<std::pair<RecordType, long>>>();
+            std::deque<std::future<void>> hashing;
+            auto submit_batch = [&] {
+                hashing.push_back(pool.submit([this, batch, &partitions, partition_bits] {
+                    add_build_pairs(*batch, partitions, partition_bits);
+                }));
+                batch = std::make_shared<std::vector<std::pair<RecordType, long>>>();
+                // Bound the records waiting to be hashed
+                while (hashing.size() > 2 * pool.size()) {
+                    hashing.front().get();
+                    hashing.pop_front();
+                }
+            };
+            scan([&](RecordType &record, long record_ref) {
+                scanned_end = record_ref + (long) sizeof(RecordType);
+                if (!record.removed) {
+                    batch->emplace_back(record, record_ref);
+                    if (batch->size() == batch_size) {
+                        submit_batch();
+                    }
+                }
+            });
+            submit_batch();
+            while (!hashing.empty()) {
+                hashing.front().get();
+                hashing.pop_front();
+            }
+            bulk_load(partitions, partition_bits, &pool);
+        }
+        indexed_end = scanned_end;
+        indexed_end_changed = true;
+        write_mark();
+        if (requires_sync(Durability::OnCheckpoint)) {
+            sync_files();
+        }
+        finish_group();
+    }
+
+    /*
+     * Auxiliary method that returns, sorted, the positions of the records at or past `from` indexed in the chain of buckets
+     * starting at bucket_ref (see `catch_up`).
+     * Assumes necessary files are already open.
+     * Accesses to disk: O(k)
+     */
+    std::vector<long> _indexed_records(long bucket_ref, long from) {
+        std::vector<long> record_refs;
+        while (bucket_ref != -1) {
+            Bucket<KeyType> &bucket = bucket_pool.pin(bucket_ref);
+            for (int i = 0; i < bucket.size; ++i) {
+                if (bucket.records[i].record_ref >= from) {
+                    record_refs.push_back(bucket.records[i].record_ref);
+                }
+            }
+            long next = bucket.next;
+            bucket_pool.unpin(bucket_ref);
+            bucket_ref = next;
+        }
+        std::sort(record_refs.begin(), record_refs.end());
+        return record_refs;
+    }
+
+
+    /*
+     * Auxiliary method for ensuring primary key consistency.
+     * Assumes necessary files are already open.
+     * Finds if a given key already exists on the index.
+     * Returns true if the key is found, and false otherwise.
+     * Accesses to disk: O(k)
+     */
+    bool _find_if_exists(KeyType key) {
         std::string hash_sequence = get_hash_sequence(key);
         auto [entry_index, bucket_ref] = hash_index->lookup(hash_sequence);
-        // Read bucket at position bucket_ref
-        SEEK_ALL(hash_file, bucket_ref)
-        Bucket<KeyType> bucket{};
-        hash_file.read((char *) &bucket, sizeof(bucket));
         // Search in chain of buckets
-        bool stop = false;
-        while (!stop) {
+        while (bucket_ref != -1) {
+            Bucket<KeyType> &bucket = bucket_pool.pin(bucket_ref);
             for (int i = 0; i < bucket.size; ++i) {
                 if (equal(key, bucket.records[i].key)) {
-                    // Found record. Add to result
-                    SEEK_ALL(raw_file, bucket.records[i].record_ref)
-                    RecordType record{};
-                    raw_file.read((char *) &record, sizeof(record));
-                    if (!record.removed) {
-                        result.push_back(record);
+                    bucket_pool.unpin(bucket_ref);
+                    return true;
+                }
+            }
+            // If there is a next bucket, explore it
+            long next = bucket.next;
+            bucket_pool.unpin(bucket_ref);
+            bucket_ref = next;
+        }
+        return false;
+    }
+
+
+    /*
+     * Insertion algorithm.
+     * Auxiliary method that avoids excessive file opening and closing when inserting.
+     * Assumes necessary files are already open.
+     * When overflow happens, a new bucket is pushed to the front of the overflow chain and linked, to allow for more efficient insertions.
+     * Throws an exception if the key of the record to be inserted is already present and the index is for a primary key.
+     * Accesses to disk: O(k + global_depth) where k is the number of buckets in an overflow chain,
+     * and global_depth is the maximum depth of the index (number of bits in the binary sequences).
+     */
+    void _insert(KeyType key, const long &record_ref) {
+        // If the attribute is a primary key, we must check whether a record with the given key already exists
+        if (primary_key && _find_if_exists(key)) {
+            throw std::runtime_error("Cannot insert a duplicate primary key.");
+        }
+        std::string hash_sequence = get_hash_sequence(key);
+        auto [entry_index, bucket_ref] = hash_index->lookup(hash_sequence);
+        // Update bucket bucket_ref if it's not full
+        Bucket<KeyType> &bucket = bucket_pool.pin(bucket_ref);
+        if (bucket.size < MAX_RECORDS_PER_BUCKET) {
+            // Append record (searches may be copying the bucket, see `read_bucket`)
+            BucketPair<KeyType> pair{key, record_ref};
+            long size = bucket.size + 1;
+            begin_change(bucket_version(bucket_ref));
+            func::atomic_copy(&bucket.records[bucket.size], &pair, sizeof(pair));
+            func::atomic_copy(&bucket.size, &size, sizeof(size));
+            end_change(bucket_version(bucket_ref));
+            bucket_pool.unpin(bucket_ref, true);
+        } else {
+            // Create new buckets and split hash index if possible
+            Bucket<KeyType> bucket_0{};
+            Bucket<KeyType> bucket_1{};
+            // Save a pointer to the end of the file (new bucket position)
+            long new_bucket_ref = allocate_bucket();
+            std::size_t local_depth = hash_index->entry(entry_index).local_depth;
+            // Split is possible, rehash the current content of the bucket into the two new buckets
+            if (local_depth < global_depth) {
+                for (int i = 0; i < bucket.size; ++i) {
+                    std::string ith_hash_seq = get_hash_sequence(bucket.records[i].key);
+                    if (ith_hash_seq[global_depth - 1 - local_depth] == '0') {
+                        bucket_0.records[bucket_0.size++] = bucket.records[i];
+                    } else {
+                        bucket_1.records[bucket_1.size++] = bucket.records[i];
                     }
-                    // If primary key, stop searching
-                    if (primary_key) {
-                        stop = true;
-                        break;
+                }
+                bool inserted = false;
+                if (bucket_0.size != MAX_RECORDS_PER_BUCKET && bucket_1.size != MAX_RECORDS_PER_BUCKET) {
+                    // Insert the new record
+                    if (hash_sequence[global_depth - 1 - local_depth] == '0') {
+                        bucket_0.records[bucket_0.size++] = BucketPair<KeyType>{key, record_ref};
+                    } else {
+                        bucket_1.records[bucket_1.size++] = BucketPair<KeyType>{key, record_ref};
                     }
+                    inserted = true;
+                }
+                // Place the new bucket at the end of the file before the split makes it visible to searches
+                bucket_pool.pin_new(new_bucket_ref) = bucket_1;
+                bucket_pool.unpin(new_bucket_ref, true);
+                // Split the current hash entry and replace the old bucket in place (searches that overlap them are retried, see `read_chains`)
+                begin_change(directory_version);
+                begin_change(bucket_version(bucket_ref));
+                hash_index->split_entry(entry_index, new_bucket_ref);
+                func::atomic_copy(&bucket, &bucket_0, sizeof(bucket));
+                end_change(bucket_version(bucket_ref));
+                end_change(directory_version);
+                bucket_pool.unpin(bucket_ref, true);
+                if (!inserted) {
+                    // Insert new record recursively (could not insert it in the current split)
+                    _insert(key, record_ref);
                 }
             }
-            // If there is a next bucket, explore it
-            if (bucket.next != -1) {
-                SEEK_ALL(hash_file, bucket.next)
-                hash_file.read((char *) &bucket, sizeof(bucket));
+            // Split was unsuccessful. Create a new bucket.
+            else {
+                bucket_pool.unpin(bucket_ref);
+                // Create new bucket
+                bucket_0.records[bucket_0.size++] = BucketPair<KeyType>{key, record_ref};
+                // Reference the parent (push front)
+                bucket_0.next = bucket_ref;
+                bucket_pool.pin_new(new_bucket_ref) = bucket_0;
+                bucket_pool.unpin(new_bucket_ref, true);
+                // Put reference to the new bucket in the directory
+                begin_change(directory_version);
+                hash_index->update_entry_bucket(entry_index, new_bucket_ref);
+                end_change(directory_version);
+            }
+        }
+    }
+
+public:
+    /*
+     * Constructor.
+     * In read-only mode (see ExtendibleHashOptions) the index must already exist, and only `search` can be used.
+     */
+    explicit ExtendibleHashFile(const std::string &fileName, const std::string &uniqueId, bool primaryKey, Index index, Equal equal = std::equal_to<KeyType>{}, Hash hash = std::hash<KeyType>{}, ExtendibleHashOptions indexOptions = {}) : options(indexOptions), raw_file_name(fileName), unique_id(uniqueId), primary_key(primaryKey), index(index), equal(equal), hash_function(hash), bucket_pool(hash_file, pool_capacity(options), pool_min_frames(options)) {
+        hash_file_name = raw_file_name + "_" + unique_id + ".ehash";
+        index_file_name = raw_file_name + "_" + unique_id + ".ehashdir";
+        wal_file_name = raw_file_name + "_" + unique_id + ".ehashwal";
+        mark_file_name = raw_file_name + "_" + unique_id + ".ehashmark";
+        if (!options.read_only) {
+            record_cache = RecordCache<RecordType>::shared(raw_file_name, options.record_cache_size);
+        }
+        index_file.open(index_file_name, options.read_only ? O_RDONLY : O_RDWR | O_CREAT);
+        if (!options.read_only) {
+            // Read before the hash file is opened (by the recovery, or below), since it records the blocks of the hash file
+            mark_file.open(mark_file_name, O_RDWR | O_CREAT);
+            long mark[2] = {};
+            std::size_t mark_size = mark_file.read((char *) mark, sizeof(mark), 0);
+            // Index built before high-water marks were kept (or not built): nothing is known to be indexed
+            indexed_end = mark_size >= sizeof(indexed_end) ? mark[0] : 0;
+            // Index built before blocks were recorded: its buckets are contiguous (see `open_hash_file`)
+            block_size = mark_size == sizeof(mark) ? mark[1] : 0;
+        }
+        if (options.write_ahead_log && !options.read_only) {
+            wal.open(wal_file_name);
+            // WAL rule: no bucket is written in place before the log that describes it is on stable storage
+            bucket_pool.set_before_write_back([this] { sync_log(); });
+        }
+        recover();
+        if (index_file.size() > 0) {
+            hash_index = new ExtendibleHash<global_depth>{index_file};
+            // Opened before any search, since searches may run concurrently
+            open_hash_file();
+            open_raw_file();
+        }
+        if (!options.read_only && options.group_commit_size > 0) {
+            committer = std::thread(&ExtendibleHashFile::run_committer, this);
+        }
+        if (options.search_threads > 1) {
+            // The caller of `search_many` is one of its threads
+            search_pool = std::make_unique<ThreadPool>(options.search_threads - 1);
+        }
+    }
+
+
+    /*
+     * Returns a bool that indicates whether the index has already been created.
+     */
+    explicit operator bool() {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        return index_file.size() > 0;
+    }
+
+
+    /*
+     * Constructs the hash index file from a fixed length binary data file.
+     * It creates 2 files: The directory file (.ehashdir) and the hash index (.ehash).
+     * The index is bulk loaded: the keys of every record are collected and sorted by bucket (see `bulk_load`),
+     * so the buckets end up as if every record had been inserted, but each one is written once instead of on every insert and split.
+     * Keys are sorted within build_memory_size bytes (see ExtendibleHashOptions): beyond that, they are sorted in runs spilled to
+     * temporary files next to the hash file, which are then merged while the buckets are built.
+     * Accesses to disk: O(n) where n is the total number of records in the data file (one sequential read, and sequential writes)
+     */
+    void create_index() {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        std::lock_guard<std::mutex> writer_lock(writer_latch);
+        build_index([this](auto consume) {
+            scan_raw_file(consume);
+        });
+    }
+
+
+    /*
+     * Constructs the index from the records produced by `scan`, instead of scanning the raw data file itself.
+     * `scan(consume)` must call `consume(record, record_ref)` once for every record of the raw data file.
+     * Used to build several indexes of the same raw data file from a single scan (see ExtendibleHashIndexSet).
+     * If the records are produced while the raw data file is being written, `expected_records` is the amount of records
+     * `scan` is expected to produce (used to split the build among the build_threads), and the raw data file should hold
+     * some of them already (their keys are sampled).
+     */
+    template<typename Scan>
+    void create_index(Scan scan, std::size_t expected_records = 0) {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        std::lock_guard<std::mutex> writer_lock(writer_latch);
+        build_index(scan, expected_records);
+    }
+
+
+    /*
+     * Indexes the records appended to the raw data file past the high-water mark (the end of the records indexed by
+     * `create_index`, `insert` of appended records or a previous `catch_up`), so appends do not require a rebuild.
+     * The keys of the appended records are collected in one sequential scan and sorted by bucket, as `create_index` does,
+     * and then inserted in that order: every bucket they modify is read and written back once, and the changes are committed together.
+     * If the index was not created yet, or at least as many records were appended as were indexed, the index is rebuilt instead.
+     * Records past the mark that are already indexed (e.g. after a crash before the mark was written) are not indexed twice:
+     * the chain of every bucket that gets appended records is read once to find them.
+     * Throws an exception if an appended record has a duplicate primary key (the mark is then not advanced).
+     * Accesses to disk: O(a + b) where a is the number of appended records (one sequential read) and b is the number of buckets modified
+     */
+    void catch_up() {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        std::lock_guard<std::mutex> writer_lock(writer_latch);
+        check_writable();
+        open_hash_file();
+        open_raw_file();
+        long appended = raw_file.size() - indexed_end;
+        if (hash_index == nullptr || appended >= indexed_end) {
+            build_index([this](auto consume) {
+                scan_raw_file(consume);
+            });
+            return;
+        }
+        if (appended < (long) sizeof(RecordType)) {
+            return;
+        }
+        ExternalSorter<BuildPair, BuildOrder> pairs(hash_file_name + ".catch_up", options.build_memory_size);
+        long scanned_end = indexed_end;
+        scan_raw_file([&](RecordType &record, long record_ref) {
+            scanned_end = record_ref + (long) sizeof(RecordType);
+            if (!record.removed) {
+                std::size_t hash = hash_function(index(record));
+                if (owns(hash)) {
+                    pairs.add(BuildPair{bucket_order(hash), hash, BucketPair<KeyType>{index(record), record_ref}});
+                }
+            }
+        }, indexed_end);
+        pairs.finish();
+        // Records past the mark may be indexed already (inserted one at a time, or before a crash kept the mark from being written).
+        // The pairs of every bucket are contiguous, so the chain of each bucket is read once for all of them, before they are inserted
+        std::vector<long> indexed_refs;// < Records past the mark indexed in the chain of the current bucket
+        std::size_t chain_mask = 0;    // < Lowest bits of the hash shared by the keys of the current bucket (its local depth)
+        std::size_t chain_prefix = 0;  // < Value of those bits
+        bool has_chain = false;
+        BuildPair pair;
+        while (pairs.next(pair)) {
+            if (!has_chain || (pair.hash & chain_mask) != chain_prefix) {
+                auto [entry_index, bucket_ref] = hash_index->lookup(get_hash_sequence(pair.pair.key));
+                chain_mask = ((std::size_t) 1 << hash_index->entry(entry_index).local_depth) - 1;
+                chain_prefix = pair.hash & chain_mask;
+                indexed_refs = _indexed_records(bucket_ref, indexed_end);
+                has_chain = true;
+            }
+            if (std::binary_search(indexed_refs.begin(), indexed_refs.end(), pair.pair.record_ref)) {
+                continue;
+            }
+            if (!options.write_ahead_log) {
+                _insert(pair.pair.key, pair.pair.record_ref);
             } else {
-                break;
+                bucket_pool.hold_modified_pages();
+                try {
+                    _insert(pair.pair.key, pair.pair.record_ref);
+                } catch (...) {
+                    log_operation();
+                    throw;
+                }
+                log_operation();
+                if (wal.size() >= (long) options.checkpoint_size) {
+                    checkpoint_log();
+                }
+            }
+        }
+        indexed_end = scanned_end;
+        indexed_end_changed = true;
+        if (wal.is_open()) {
+            checkpoint_log();
+        } else {
+            write_back();
+            if (requires_sync(Durability::OnCheckpoint)) {
+                sync_files();
+            }
+        }
+        finish_group();
+    }
+
+
+    /*
+     * Returns the high-water mark: every record before this position of the raw data file is indexed.
+     */
+    long indexed_size() {
+        std::lock_guard<std::mutex> lock(writer_latch);
+        return indexed_end;
+    }
+
+
+    /*
+     * Searches a given key.
+     * Returns a vector of elements that match the given key.
+     * If the index was created for primary keys, it returns a single element.
+     * If no element matches the given key, it returns an empty vector.
+     * Matching records are collected first and then fetched in the order they appear in the raw data file,
+     * merging nearby records into a single read.
+     * Searches may run from several threads at the same time, and concurrently with `insert`, without latching the directory or the buckets:
+     * buckets are copied and validated with their version, and the chain is followed again if a split overlapped it (see `read_chains`).
+     * Accesses to disk: O(k + r) where k is the length of the bucket chain accessed (buckets cached in the buffer pool are not read again),
+     * and r is the number of runs of nearby matching records
+     */
+    std::vector<RecordType> search(KeyType key) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        check_created();
+        std::string hash_sequence = get_hash_sequence(key);
+        std::vector<std::pair<std::size_t, long>> matches;
+        read_chains([&] {
+            matches.clear();
+            auto [entry_index, bucket_ref] = hash_index->find(hash_sequence);
+            if (entry_index == (std::size_t) -1) {
+                return false;
+            }
+            // Search in chain of buckets
+            Bucket<KeyType> bucket;
+            bool stop = false;
+            while (!stop && bucket_ref != -1) {
+                read_bucket(bucket_ref, bucket);
+                for (int i = 0; i < bucket.size; ++i) {
+                    if (equal(key, (KeyType &) bucket.records[i].key)) {
+                        // Found record. Fetch it later
+                        matches.emplace_back(0, bucket.records[i].record_ref);
+                        // If primary key, stop searching
+                        if (primary_key) {
+                            stop = true;
+                            break;
+                        }
+                    }
+                }
+                // If there is a next bucket, explore it
+                bucket_ref = bucket.next;
+            }
+            return true;
+        });
+        std::vector<std::vector<RecordType>> result(1);
+        fetch_records(matches, result);
+        return std::move(result[0]);
+    }
+
+
+    /*
+     * Searches several keys at once.
+     * Returns, for every key (in the same order), the elements that match it, as `search` would.
+     * Repeated keys are searched once, and the keys whose directory entries point to the same bucket are searched together,
+     * so every bucket chain is read once whatever the amount of keys that lead to it.
+     * Chains are followed level by level: all the buckets of a level that are not cached are read in a single batch,
+     * and then all the matching records are read in a single batch of coalesced reads, in the order they appear in the raw data file.
+     * With several search_threads (see ExtendibleHashOptions) and at least SEARCH_PARALLEL_MIN_KEYS distinct keys, the chains are spread among
+     * the threads, which claim SEARCH_GROUPS_PER_TASK of them at a time until none is left, so their batches of reads are in flight at the same time.
+     * Each thread then reads the records of the keys it searched.
+     * Like `search`, it runs concurrently with inserts (if a split overlaps it, the chains are followed again).
+     * Accesses to disk: O(k + 1) batches where k is the length of the longest bucket chain accessed (per thread, with several search threads)
+     */
+    std::vector<std::vector<RecordType>> search_many(KeyType *keys, std::size_t count) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        check_created();
+        std::vector<std::string> hash_sequences;
+        for (std::size_t i = 0; i < count; ++i) {
+            hash_sequences.push_back(get_hash_sequence(keys[i]));
+        }
+        // Equal keys have the same hash sequence: sort by it, and search only the first of every run of equal keys
+        std::vector<std::size_t> sorted(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            sorted[i] = i;
+        }
+        std::sort(sorted.begin(), sorted.end(), [&](std::size_t a, std::size_t b) {
+            return hash_sequences[a] != hash_sequences[b] ? hash_sequences[a] < hash_sequences[b] : a < b;
+        });
+        // Position of the key searched in place of every key (itself, unless an equal key comes before it)
+        std::vector<std::size_t> searched_as(count);
+        std::vector<std::size_t> unique;
+        std::size_t run_start = 0;
+        for (std::size_t j = 0; j < count; ++j) {
+            std::size_t i = sorted[j];
+            if (j > 0 && hash_sequences[i] != hash_sequences[sorted[j - 1]]) {
+                run_start = unique.size();
+            }
+            searched_as[i] = i;
+            for (std::size_t u = run_start; u < unique.size(); ++u) {
+                if (equal(keys[i], keys[unique[u]])) {
+                    searched_as[i] = unique[u];
+                    break;
+                }
+            }
+            if (searched_as[i] == i) {
+                unique.push_back(i);
+            }
+        }
+        // Pairs (key position, record_ref) of the records matched by every thread
+        std::vector<std::vector<std::pair<std::size_t, long>>> matches;
+        read_chains([&] {
+            std::vector<ChainGroup> groups;
+            if (!group_chains(unique, hash_sequences, groups)) {
+                return false;
+            }
+            std::size_t workers = 1;
+            if (search_pool != nullptr && unique.size() >= SEARCH_PARALLEL_MIN_KEYS) {
+                workers = std::min(search_pool->size() + 1, (groups.size() + SEARCH_GROUPS_PER_TASK - 1) / SEARCH_GROUPS_PER_TASK);
+            }
+            matches.assign(workers, {});
+            if (workers == 1) {
+                follow_chains(std::move(groups), keys, matches[0]);
+                return true;
+            }
+            // Every thread claims the next groups until none is left, so the threads that get short chains search more of them
+            std::atomic<std::size_t> next_group{0};
+            run_search_workers(workers, [&](std::size_t worker) {
+                std::size_t first;
+                while ((first = next_group.fetch_add(SEARCH_GROUPS_PER_TASK)) < groups.size()) {
+                    std::size_t last = std::min(groups.size(), first + SEARCH_GROUPS_PER_TASK);
+                    follow_chains(std::vector<ChainGroup>(groups.begin() + first, groups.begin() + last), keys, matches[worker]);
+                }
+            });
+            return true;
+        });
+        // Every thread reads the matching records of the keys it searched in one batch (the records of a key are all matched by the same thread)
+        std::vector<std::vector<RecordType>> result(count);
+        run_search_workers(matches.size(), [&](std::size_t worker) {
+            fetch_records(matches[worker], result);
+        });
+        for (std::size_t i = 0; i < count; ++i) {
+            if (searched_as[i] != i) {
+                result[i] = result[searched_as[i]];
             }
         }
-        hash_file.close();
-        raw_file.close();
         return result;
     }
 
+    std::vector<std::vector<RecordType>> search_many(std::vector<KeyType> &keys) {
+        return search_many(keys.data(), keys.size());
+    }
+
 
     /*
      * Inserts a given key in the hash index.
      * When overflow happens, a new bucket is pushed to the front of the overflow chain and linked, to allow for more efficient insertions.
-     * Throws an exception if the key of the record to be inserted is already present and the index is for a primary key.
+     * Throws an exception if the key of the record to be inserted is already present and the index is for a primary key,
+     * or if the index is a shard and the key belongs to another one.
+     * In group commit mode (see ExtendibleHashOptions) inserts are accumulated until group_commit_size of them arrive
+     * or group_commit_window expires, and then they are committed together. With Durability::PerBatch or higher, the insert
+     * returns once its group is on stable storage (other inserts join the group meanwhile), and throws the exception of its commit if it failed.
+     * Otherwise, the modified buckets and directory entries are written through (or logged, with a write-ahead log).
+     * Whether the insert is on stable storage when it returns depends on the durability level (see Durability).
+     * Inserts are serialized with each other but not with searches: the version of the bucket appended to is bumped,
+     * and the version of the directory only while a bucket is split or an overflow bucket is linked.
      * Accesses to disk: O(k + global_depth) where k is the number of buckets in an overflow chain,
      * and global_depth is the maximum depth of the index (number of bits in the binary sequences).
      */
     void insert(RecordType &record, const long &record_ref) {
-        SAFE_FILE_OPEN(hash_file, hash_file_name, flags)
-        SAFE_FILE_OPEN(index_file, hash_file_name, flags | std::ios::trunc)
-        _insert(record, record_ref);
-        hash_index->write_to_disk(index_file);
-        hash_file.close();
-        index_file.close();
+        std::shared_lock<std::shared_mutex> lock(latch);
+        std::unique_lock<std::mutex> writer_lock(writer_latch);
+        check_writable();
+        check_created();
+        if (!owns(hash_function(index(record)))) {
+            throw std::runtime_error("Cannot insert a key that belongs to another shard.");
+        }
+        if (!options.write_ahead_log) {
+            _insert(index(record), record_ref);
+        } else {
+            bucket_pool.hold_modified_pages();
+            try {
+                _insert(index(record), record_ref);
+            } catch (...) {
+                log_operation();
+                throw;
+            }
+            log_operation();
+            if (wal.size() >= (long) options.checkpoint_size) {
+                checkpoint_log();
+            }
+        }
+        // Records appended and inserted one at a time keep the high-water mark up to date
+        if (record_ref == indexed_end) {
+            indexed_end += sizeof(RecordType);
+            indexed_end_changed = true;
+        }
+        if (options.group_commit_size == 0) {
+            if (!options.write_ahead_log) {
+                write_back();
+            }
+        } else {
+            if (open_group == nullptr) {
+                open_group = std::make_shared<CommitGroup>();
+                group_deadline = std::chrono::steady_clock::now() + options.group_commit_window;
+                group_started.notify_one();
+            }
+            std::shared_ptr<CommitGroup> group = open_group;
+            if (++pending_inserts >= options.group_commit_size) {
+                commit_group();
+            } else if (requires_sync(Durability::PerBatch)) {
+                // Wait for the group to be committed by the insert that fills it, the committer or `commit`
+                group_committed.wait(writer_lock, [&] {
+                    return group->committed;
+                });
+                if (group->error) {
+                    std::rethrow_exception(group->error);
+                }
+            }
+        }
+        make_durable(Durability::PerOperation);
     }
 
 
@@ -558,47 +2259,127 @@ public:
      * Accesses to disk: O(k) where k is the length of the bucket chain accessed.
      */
     void remove(KeyType key) {
-        SAFE_FILE_OPEN(hash_file, hash_file_name, flags)
-        SAFE_FILE_OPEN(raw_file, raw_file_name, flags)
+        std::unique_lock<std::shared_mutex> lock(latch);
+        std::lock_guard<std::mutex> writer_lock(writer_latch);
+        check_writable();
+        check_created();
         std::string hash_sequence = get_hash_sequence(key);
         auto [entry_index, bucket_ref] = hash_index->lookup(hash_sequence);
-        // Read bucket at position bucket_ref
-        SEEK_ALL(hash_file, bucket_ref)
-        Bucket<KeyType> bucket{};
-        hash_file.read((char *) &bucket, sizeof(bucket));
         // Search in chain of buckets
-        long current_bucket_ref = bucket_ref;
-        while (true) {
+        std::vector<std::pair<long, RecordType>> removed_records;
+        bool stop = false;
+        while (!stop && bucket_ref != -1) {
+            Bucket<KeyType> &bucket = bucket_pool.pin(bucket_ref);
             for (int i = bucket.size - 1; i >= 0; --i) {
                 if (equal(key, bucket.records[i].key)) {
-                    // Mark record as deleted in the data file.
+                    // Mark record as deleted
                     long record_ref = bucket.records[i].record_ref;
-                    SEEK_ALL(raw_file, record_ref)
                     RecordType record{};
-                    raw_file.read((char *) &record, sizeof(record));
+                    raw_file.read((char *) &record, sizeof(record), record_ref);
                     record.removed = true;
-                    SEEK_ALL(raw_file, record_ref)
-                    raw_file.write((char *) &record, sizeof(record));
+                    removed_records.emplace_back(record_ref, record);
                     // If primary key, stop searching
                     if (primary_key) {
-                        return;
+                        stop = true;
+                        break;
                     }
                 }
             }
             // If there is a next bucket, explore it
-            if (bucket.next != -1) {
-                current_bucket_ref = bucket.next;
-                SEEK_ALL(hash_file, bucket.next)
-                hash_file.read((char *) &bucket, sizeof(bucket));
-            } else {
-                break;
+            long next = bucket.next;
+            bucket_pool.unpin(bucket_ref);
+            bucket_ref = next;
+        }
+        if (removed_records.empty()) {
+            return;
+        }
+        if (options.write_ahead_log) {
+            // The records are written in place right away, so the log must reach stable storage first
+            for (auto &[record_ref, record]: removed_records) {
+                wal.add(LogTarget::RawFile, record_ref, (const char *) &record, sizeof(record));
+            }
+            wal.append();
+            sync_log();
+        }
+        // Update the data file
+        for (auto &[record_ref, record]: removed_records) {
+            raw_file.write((char *) &record, sizeof(record), record_ref);
+            record_cache->invalidate(record_ref);
+        }
+        if (options.write_ahead_log && wal.size() >= (long) options.checkpoint_size) {
+            checkpoint_log();
+        }
+        make_durable(Durability::PerOperation);
+    }
+
+
+    /*
+     * Writes every bucket modified in the buffer pool and every modified directory entry back to disk.
+     */
+    void flush() {
+        std::lock_guard<std::mutex> lock(writer_latch);
+        write_back();
+    }
+
+
+    /*
+     * Writes every change in place and, with Durability::OnCheckpoint or higher, forces the files to stable storage.
+     * With a write-ahead log, it's then emptied (done automatically when the log reaches checkpoint_size).
+     * It then rethrows the failure of a previous background commit, if any (see `commit`).
+     * The destructor does the same, but cannot report a failure: call it before destroying the index to learn about them.
+     * Accesses to disk: O(r) where r is the number of runs of adjacent modified buckets and directory entries
+     */
+    void checkpoint() {
+        std::lock_guard<std::mutex> lock(writer_latch);
+        if (options.read_only) {
+            return;
+        }
+        if (wal.is_open()) {
+            checkpoint_log();
+        } else {
+            write_back();
+            if (requires_sync(Durability::OnCheckpoint)) {
+                sync_files();
             }
         }
-        hash_file.close();
-        raw_file.close();
+        finish_group();
+        check_commit_error();
+    }
+
+
+    /*
+     * Commits the inserts accumulated so far. With Durability::PerBatch or higher, it returns once they are on stable storage.
+     * Below Durability::PerBatch inserts do not wait for their group, so it rethrows the failure of a previous background commit, if any.
+     */
+    void commit() {
+        std::lock_guard<std::mutex> lock(writer_latch);
+        check_commit_error();
+        if (!options.read_only) {
+            commit_group();
+        }
     }
 
     virtual ~ExtendibleHashFile() {
+        if (committer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(writer_latch);
+                stopping = true;
+            }
+            group_started.notify_one();
+            committer.join();
+        }
+        // A destructor cannot throw: failures are lost here, and reported by an explicit `checkpoint` (or `flush`) instead
+        try {
+            if (wal.is_open()) {
+                checkpoint_log();
+            } else if (!options.read_only) {
+                write_back();
+                if (requires_sync(Durability::OnCheckpoint)) {
+                    sync_files();
+                }
+            }
+        } catch (...) {
+        }
         delete hash_index;
     }
 };
@@ -0,0 +1,290 @@
+#ifndef EXTENDIBLE_HASH_EXTENDIBLEHASHINDEXSET_HPP
+#define EXTENDIBLE_HASH_EXTENDIBLEHASHINDEXSET_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DiskFile.hpp"
+#include "ExtendibleHashFile.hpp"
+
+/*
+ * Size (in bytes) of the chunks in which an index set reads the raw data file.
+ */
+
+#ifndef INDEX_SET_CHUNK_SIZE
+#define INDEX_SET_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+
+/*
+ * Maximum amount of chunks read by an index set that may be waiting for its indexes at the same time.
+ */
+
+#ifndef INDEX_SET_CHUNKS_IN_FLIGHT
+#define INDEX_SET_CHUNKS_IN_FLIGHT 4
+#endif
+
+/*
+ * Builds several indexes of the same raw data file (e.g. on different attributes) from a single sequential scan.
+ * The raw data file is read in chunks of INDEX_SET_CHUNK_SIZE bytes, and every chunk is handed to all the indexes.
+ * Each index is built in its own thread (its own pipeline of key extraction, hashing and sorting, see ExtendibleHashFile::create_index),
+ * so the indexes are built concurrently while the raw data file is read only once.
+ * At most INDEX_SET_CHUNKS_IN_FLIGHT chunks are kept in memory: the scan waits for the slowest index.
+ * `File` is the storage backend used to read the raw data file.
+ */
+template<typename RecordType, typename File = DiskFile>
+class ExtendibleHashIndexSet {
+    struct Chunk {
+        long first_ref = 0;             // < Position of the first record in the raw data file
+        std::vector<RecordType> records;// < Records of the chunk
+    };
+
+    /*
+     * Chunks read by the scan, kept until every index has consumed them.
+     */
+    class Pipeline {
+        std::mutex mutex;                               // < Protects the pipeline
+        std::condition_variable changed;                // < Signals new chunks, consumed chunks and the end of the scan
+        std::deque<std::shared_ptr<const Chunk>> chunks;// < Chunks not consumed by every index yet
+        std::size_t first_chunk = 0;                    // < Sequence number of the first chunk in `chunks`
+        std::vector<std::size_t> positions;             // < Sequence number of the next chunk of every index
+        bool ended = false;                             // < Is `true` once every chunk has been read
+        bool failed = false;                            // < Is `true` if the scan could not be completed
+        std::size_t expected_records;                   // < Amount of records the scan is expected to publish, if they are not in the raw data file yet (0 otherwise)
+
+        // Drops the chunks every index has consumed
+        void trim() {
+            std::size_t slowest = *std::min_element(positions.begin(), positions.end());
+            while (!chunks.empty() && first_chunk < slowest) {
+                chunks.pop_front();
+                ++first_chunk;
+            }
+        }
+
+    public:
+        Pipeline(std::size_t indexes, std::size_t expected_records) : positions(indexes, 0), expected_records(expected_records) {}
+
+        std::size_t get_expected_records() const {
+            return expected_records;
+        }
+
+        /*
+         * Waits until the index at position `index_position` has a chunk to take, or the scan has ended.
+         */
+        void wait(std::size_t index_position) {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::size_t &position = positions[index_position];
+            changed.wait(lock, [&] {
+                return failed || ended || position < first_chunk + chunks.size();
+            });
+        }
+
+        /*
+         * Adds a chunk, waiting until fewer than INDEX_SET_CHUNKS_IN_FLIGHT chunks are pending.
+         */
+        void publish(std::shared_ptr<const Chunk> chunk) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] {
+                trim();
+                return chunks.size() < INDEX_SET_CHUNKS_IN_FLIGHT;
+            });
+            chunks.push_back(std::move(chunk));
+            changed.notify_all();
+        }
+
+        /*
+         * Returns the next chunk of the index at position `index_position`, or nullptr once the scan has ended.
+         * Throws an exception if the scan failed.
+         */
+        std::shared_ptr<const Chunk> take(std::size_t index_position) {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::size_t &position = positions[index_position];
+            changed.wait(lock, [&] {
+                return failed || ended || position < first_chunk + chunks.size();
+            });
+            if (failed) {
+                throw std::runtime_error("Could not read records from raw data file.");
+            }
+            if (position == first_chunk + chunks.size()) {
+                return nullptr;
+            }
+            std::shared_ptr<const Chunk> chunk = chunks[position - first_chunk];
+            ++position;
+            trim();
+            changed.notify_all();
+            return chunk;
+        }
+
+        /*
+         * Stops handing chunks to the index at position `index_position` (its build has finished or failed).
+         */
+        void leave(std::size_t index_position) {
+            std::lock_guard<std::mutex> lock(mutex);
+            positions[index_position] = std::numeric_limits<std::size_t>::max();
+            trim();
+            changed.notify_all();
+        }
+
+        void end() {
+            std::lock_guard<std::mutex> lock(mutex);
+            ended = true;
+            changed.notify_all();
+        }
+
+        void fail() {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+            changed.notify_all();
+        }
+    };
+
+    std::string raw_file_name;                                       // < Raw data file name
+    std::vector<std::function<void(Pipeline &, std::size_t)>> builds;// < Builds every index from the chunks of the pipeline
+
+    /*
+     * Reads the raw data file sequentially, in chunks, and publishes them.
+     * As ExtendibleHashFile does for its own scans, every SCAN_CACHE_WINDOW bytes it drops from the page cache the pages it brought in (see ScanCache).
+     */
+    void scan(Pipeline &pipeline) {
+        File raw_file;
+        raw_file.open(raw_file_name, O_RDONLY);
+        raw_file.advise(AccessPattern::Sequential);
+        std::size_t chunk_records = std::max<std::size_t>(1, INDEX_SET_CHUNK_SIZE / sizeof(RecordType));
+        ScanCache<File> scan_cache(raw_file, 0);
+        long record_ref = 0;
+        while (true) {
+            auto chunk = std::make_shared<Chunk>();
+            chunk->first_ref = record_ref;
+            chunk->records.resize(chunk_records);
+            scan_cache.before_read(record_ref + (long) (chunk_records * sizeof(RecordType)));
+            std::size_t bytes = raw_file.read((char *) chunk->records.data(), chunk_records * sizeof(RecordType), record_ref);
+            chunk->records.resize(bytes / sizeof(RecordType));
+            scan_cache.after_read(record_ref + (long) (chunk->records.size() * sizeof(RecordType)));
+            if (chunk->records.empty()) {
+                break;
+            }
+            record_ref += (long) (chunk->records.size() * sizeof(RecordType));
+            pipeline.publish(std::move(chunk));
+        }
+        scan_cache.finish();
+    }
+
+    /*
+     * Builds every registered index from the chunks published by `source(pipeline)`, each index in its own thread.
+     */
+    template<typename Source>
+    void build(Source source, std::size_t expected_records) {
+        Pipeline pipeline(builds.size(), expected_records);
+        std::vector<std::exception_ptr> errors(builds.size());
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < builds.size(); ++i) {
+            threads.emplace_back([&, i] {
+                try {
+                    builds[i](pipeline, i);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+                pipeline.leave(i);
+            });
+        }
+        std::exception_ptr scan_error;
+        try {
+            source(pipeline);
+            pipeline.end();
+        } catch (...) {
+            scan_error = std::current_exception();
+            pipeline.fail();
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        if (scan_error) {
+            std::rethrow_exception(scan_error);
+        }
+        for (auto &error: errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+public:
+    explicit ExtendibleHashIndexSet(std::string raw_file_name) : raw_file_name(std::move(raw_file_name)) {}
+
+    /*
+     * Registers an index of the raw data file, to be built by `create_indexes`.
+     * The index must outlive the set (or at least the call to `create_indexes`).
+     */
+    template<typename ExtendibleHashFileType>
+    void add(ExtendibleHashFileType &index) {
+        builds.emplace_back([&index](Pipeline &pipeline, std::size_t index_position) {
+            // The build samples the keys of the records in the raw data file (see ExtendibleHashFile::create_index), so it starts once some are written
+            pipeline.wait(index_position);
+            index.create_index([&](auto consume) {
+                while (std::shared_ptr<const Chunk> chunk = pipeline.take(index_position)) {
+                    for (std::size_t i = 0; i < chunk->records.size(); ++i) {
+                        RecordType record = chunk->records[i];
+                        consume(record, chunk->first_ref + (long) (i * sizeof(RecordType)));
+                    }
+                }
+            }, pipeline.get_expected_records());
+        });
+    }
+
+    /*
+     * Builds every registered index (as `create_index` would) reading the raw data file once.
+     * Throws the exception of the first index that could not be built, once the others are finished.
+     * Accesses to disk: O(n) where n is the total number of records in the data file (one sequential read for all the indexes)
+     */
+    void create_indexes() {
+        if (builds.empty()) {
+            return;
+        }
+        build([this](Pipeline &pipeline) {
+            scan(pipeline);
+        }, 0);
+    }
+
+
+    /*
+     * Builds every registered index from the records produced by `produce(emit)` instead of reading the raw data file,
+     * e.g. while the raw data file is being written (see ingest_data).
+     * `produce` must call `emit(records, count)` with every record of the raw data file, in order, starting with the first one,
+     * once the records are written to the raw data file.
+     * `expected_records` is the amount of records `produce` is expected to emit: as the raw data file is not complete when the builds start,
+     * it decides how each build is split among its build_threads (with 0, only the records written when the builds start count).
+     * Throws the exception of `produce`, or else of the first index that could not be built, once the others are finished.
+     */
+    template<typename Produce>
+    void create_indexes(Produce produce, std::size_t expected_records = 0) {
+        if (builds.empty()) {
+            produce([](const RecordType *, std::size_t) {});
+            return;
+        }
+        build([&](Pipeline &pipeline) {
+            long record_ref = 0;
+            produce([&](const RecordType *records, std::size_t count) {
+                if (count == 0) {
+                    return;
+                }
+                auto chunk = std::make_shared<Chunk>();
+                chunk->first_ref = record_ref;
+                chunk->records.assign(records, records + count);
+                record_ref += (long) (count * sizeof(RecordType));
+                pipeline.publish(std::move(chunk));
+            });
+        }, expected_records);
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_EXTENDIBLEHASHINDEXSET_HPP
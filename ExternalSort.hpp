@@ -0,0 +1,178 @@
+#ifndef EXTENDIBLE_HASH_EXTERNALSORT_HPP
+#define EXTENDIBLE_HASH_EXTERNALSORT_HPP
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "DiskFile.hpp"
+
+/*
+ * Sorts a sequence of items of a trivially copyable type using a bounded amount of memory.
+ * Items are accumulated in memory until `memory_budget` bytes are used; then they are sorted and spilled to a temporary file as a run.
+ * Once every item has been added (`finish`), the runs are merged in a single pass and `next` returns the items in order.
+ * Every run is read back sequentially through its own buffer, and the buffers of all the runs together fit the budget.
+ * If every item fits in memory nothing is written to disk. Temporary files are removed as soon as they are created
+ * (they live until the sorter is destroyed), so nothing is left behind by a crash.
+ */
+template<typename T, typename Less = std::less<T>>
+class ExternalSorter {
+    static_assert(std::is_trivially_copyable<T>::value, "Items are spilled to disk and read back as bytes.");
+
+    struct Run {
+        DiskFile file;           // < Sorted items spilled to disk
+        long position = 0;       // < Position of the next item to be read into the buffer
+        std::vector<T> buffer;   // < Items of the run read ahead
+        std::size_t buffered = 0;// < Position of the next item in the buffer
+    };
+
+    std::string file_prefix;               // < Prefix of the names of the temporary files
+    std::size_t memory_budget;             // < Amount of RAM (in bytes) the sorter may use for items
+    Less less;                             // < Order of the items
+    std::vector<T> items;                  // < Items kept in memory (the whole sequence if no run was spilled)
+    std::size_t items_read = 0;            // < Position of the next item returned from `items`
+    std::vector<std::unique_ptr<Run>> runs;// < Runs spilled to disk
+    std::size_t item_count = 0;            // < Amount of items added
+    bool finished = false;                 // < Is `true` once every item has been added
+
+    // Pairs (head item, run position) of the runs being merged, with the smallest head on top
+    struct HeadOrder {
+        Less less;
+
+        bool operator()(const std::pair<T, std::size_t> &a, const std::pair<T, std::size_t> &b) const {
+            return less(b.first, a.first);
+        }
+    };
+    std::priority_queue<std::pair<T, std::size_t>, std::vector<std::pair<T, std::size_t>>, HeadOrder> heads;
+
+    std::size_t items_capacity() const {
+        return std::max<std::size_t>(1, memory_budget / sizeof(T));
+    }
+
+    /*
+     * Sorts the items in memory and writes them to a new run with a single sequential write.
+     */
+    void spill() {
+        std::sort(items.begin(), items.end(), less);
+        auto run = std::make_unique<Run>();
+        std::string file_name = file_prefix + "." + std::to_string(runs.size()) + ".run";
+        run->file.open(file_name, O_RDWR | O_CREAT | O_TRUNC);
+        ::unlink(file_name.c_str());
+        run->file.write((const char *) items.data(), items.size() * sizeof(T), 0);
+        runs.push_back(std::move(run));
+        items.clear();
+    }
+
+    /*
+     * Takes the next item of a run. Returns `false` when the run is exhausted.
+     */
+    bool take(Run &run, T &item) {
+        if (run.buffered == run.buffer.size()) {
+            run.buffer.resize(run.buffer.capacity());
+            std::size_t bytes = run.file.read((char *) run.buffer.data(), run.buffer.size() * sizeof(T), run.position);
+            run.position += (long) bytes;
+            run.buffer.resize(bytes / sizeof(T));
+            run.buffered = 0;
+            if (run.buffer.empty()) {
+                return false;
+            }
+        }
+        item = run.buffer[run.buffered++];
+        return true;
+    }
+
+public:
+    /*
+     * Constructor. Temporary files are named after `file_prefix` (e.g. the file being built, so they are placed next to it).
+     */
+    ExternalSorter(std::string file_prefix, std::size_t memory_budget, Less less = Less{}) : file_prefix(std::move(file_prefix)), memory_budget(memory_budget), less(less), heads(HeadOrder{less}) {}
+
+    ExternalSorter(const ExternalSorter &) = delete;
+
+    ExternalSorter &operator=(const ExternalSorter &) = delete;
+
+    void add(const T &item) {
+        if (finished) {
+            throw std::runtime_error("Cannot add items to a finished sort.");
+        }
+        if (items.size() == items_capacity()) {
+            spill();
+        }
+        if (items.size() == items.capacity()) {
+            // Grow geometrically, but never beyond the budget
+            items.reserve(std::min(items_capacity(), std::max<std::size_t>(1, 2 * items.size())));
+        }
+        items.push_back(item);
+        ++item_count;
+    }
+
+    /*
+     * Sorts the items added (merging the runs, if any were spilled). Afterwards items can only be taken with `next`.
+     */
+    void finish() {
+        finished = true;
+        if (runs.empty()) {
+            std::sort(items.begin(), items.end(), less);
+            return;
+        }
+        spill();
+        items.shrink_to_fit();
+        std::size_t run_capacity = std::max<std::size_t>(1, items_capacity() / runs.size());
+        for (std::size_t i = 0; i < runs.size(); ++i) {
+            runs[i]->buffer.reserve(run_capacity);
+            runs[i]->file.advise(AccessPattern::Sequential);
+            T item;
+            if (take(*runs[i], item)) {
+                heads.emplace(item, i);
+            }
+        }
+    }
+
+    /*
+     * Amount of items added.
+     */
+    std::size_t size() const {
+        return item_count;
+    }
+
+    /*
+     * Amount of runs spilled to disk.
+     */
+    std::size_t run_count() const {
+        return runs.size();
+    }
+
+    /*
+     * Takes the next item in order. Returns `false` once every item has been taken.
+     */
+    bool next(T &item) {
+        if (runs.empty()) {
+            if (items_read == items.size()) {
+                return false;
+            }
+            item = items[items_read++];
+            return true;
+        }
+        if (heads.empty()) {
+            return false;
+        }
+        auto [head, run_position] = heads.top();
+        heads.pop();
+        item = head;
+        T following;
+        if (take(*runs[run_position], following)) {
+            heads.emplace(following, run_position);
+        }
+        return true;
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_EXTERNALSORT_HPP
@@ -0,0 +1,59 @@
+#ifndef EXTENDIBLE_HASH_HYPERLOGLOG_HPP
+#define EXTENDIBLE_HASH_HYPERLOGLOG_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Estimates the amount of distinct values of a sequence from their hashes, using 2^precision bytes whatever the amount of values
+ * (HyperLogLog, with linear counting for small cardinalities). The standard error is about 1.04 / sqrt(2^precision), 1.6% by default.
+ * Hashes are mixed before being used, so weak hash functions (e.g. std::hash of an integer, the integer itself) are fine.
+ */
+class HyperLogLog {
+    std::size_t precision;         // < Amount of bits of the hash that select a register
+    std::vector<uint8_t> registers;// < Longest run of leading zeros (plus one) seen by every register
+
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 30;
+        hash *= 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94d049bb133111ebULL;
+        hash ^= hash >> 31;
+        return hash;
+    }
+
+public:
+    explicit HyperLogLog(std::size_t precision = 12) : precision(std::min<std::size_t>(std::max<std::size_t>(precision, 4), 18)), registers((std::size_t) 1 << this->precision, 0) {}
+
+    void add(uint64_t hash) {
+        hash = mix(hash);
+        std::size_t position = hash >> (64 - precision);
+        // The remaining bits, with a guard bit so the run of zeros is bounded
+        uint64_t rest = (hash << precision) | ((uint64_t) 1 << (precision - 1));
+        uint8_t rank = (uint8_t) (__builtin_clzll(rest) + 1);
+        registers[position] = std::max(registers[position], rank);
+    }
+
+    /*
+     * Returns the estimated amount of distinct values added.
+     */
+    double estimate() const {
+        double m = (double) registers.size();
+        double sum = 0;
+        std::size_t zeros = 0;
+        for (uint8_t rank: registers) {
+            sum += std::ldexp(1.0, -rank);
+            zeros += rank == 0;
+        }
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (estimate <= 2.5 * m && zeros > 0) {
+            estimate = m * std::log(m / (double) zeros);
+        }
+        return estimate;
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_HYPERLOGLOG_HPP
@@ -0,0 +1,300 @@
+#ifndef EXTENDIBLE_HASH_IOURING_HPP
+#define EXTENDIBLE_HASH_IOURING_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <sys/uio.h>
+
+/*
+ * A single positional transfer of a batch.
+ * `done` holds the amount of bytes actually transferred, so requests that could not be completed can be retried.
+ */
+struct IoRequest {
+    char *buffer = nullptr;// < Source or destination of the data
+    std::size_t size = 0;  // < Amount of bytes to transfer
+    long offset = 0;       // < Position in the file
+    std::size_t done = 0;  // < Amount of bytes transferred so far
+};
+
+/*
+ * A positional transfer scattered over several buffers (as in preadv).
+ */
+struct IoVectorRequest {
+    const iovec *vector = nullptr;// < Buffers filled in order
+    int count = 0;                // < Number of buffers
+    long offset = 0;              // < Position in the file
+    std::size_t size = 0;         // < Sum of the sizes of the buffers
+    std::size_t done = 0;         // < Amount of bytes transferred
+};
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// <linux/io_uring.h> pulls <linux/fs.h>, whose BLOCK_SIZE clashes with the one used for buckets
+#undef BLOCK_SIZE
+
+/*
+ * Minimal io_uring instance (raw syscalls, no liburing required).
+ * A batch of positional reads or writes is submitted at once, keeping up to `entries` operations in flight
+ * from a single thread. If the kernel does not support io_uring, `is_available` returns `false` and nothing is submitted.
+ */
+class IoUring {
+    int ring_fd = -1;            // < io_uring file descriptor (-1 if unavailable)
+    unsigned entries = 0;        // < Size of the submission queue
+    void *sq_ring = nullptr;     // < Submission ring mapping
+    std::size_t sq_ring_size = 0;// < Size of the submission ring mapping
+    void *cq_ring = nullptr;     // < Completion ring mapping (same as sq_ring with IORING_FEAT_SINGLE_MMAP)
+    std::size_t cq_ring_size = 0;// < Size of the completion ring mapping
+    io_uring_sqe *sqes = nullptr;// < Submission queue entries
+    std::size_t sqes_size = 0;   // < Size of the submission queue entries mapping
+    unsigned *sq_tail = nullptr; // < Pointers into the rings shared with the kernel
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    void release() {
+        if (sqes != nullptr) {
+            ::munmap(sqes, sqes_size);
+            sqes = nullptr;
+        }
+        if (cq_ring != nullptr && cq_ring != sq_ring) {
+            ::munmap(cq_ring, cq_ring_size);
+        }
+        cq_ring = nullptr;
+        if (sq_ring != nullptr) {
+            ::munmap(sq_ring, sq_ring_size);
+            sq_ring = nullptr;
+        }
+        if (ring_fd != -1) {
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    /*
+     * Submits `count` operations, keeping the ring as full as possible.
+     * `prepare(sqe, i)` fills the entry of the i-th operation and `complete(i, res)` receives its result.
+     * If the ring fails, the operations the kernel has not consumed are withdrawn (`complete` is not called for them) and the ring is released,
+     * but only once the operations in flight have completed, as they still use the buffers of the caller.
+     */
+    template<typename Prepare, typename Complete>
+    void run(std::size_t count, Prepare prepare, Complete complete) {
+        std::size_t submitted = 0;// < Operations placed in the submission queue
+        unsigned queued = 0;      // < Operations placed but not yet consumed by the kernel
+        std::size_t in_flight = 0;// < Operations consumed by the kernel but not completed
+        bool failed = false;      // < Is `true` once io_uring_enter failed: nothing else is submitted
+        while ((!failed && submitted < count) || queued > 0 || in_flight > 0) {
+            // Fill the submission queue
+            unsigned tail = *sq_tail;
+            while (!failed && submitted < count && in_flight + queued < entries) {
+                unsigned index = tail & *sq_mask;
+                io_uring_sqe &sqe = sqes[index];
+                std::memset(&sqe, 0, sizeof(sqe));
+                prepare(sqe, submitted);
+                sqe.user_data = submitted;
+                sq_array[index] = index;
+                ++tail;
+                ++queued;
+                ++submitted;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            // Submit and wait for at least one completion
+            int ret = (int) ::syscall(__NR_io_uring_enter, ring_fd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (!failed) {
+                    // A failed io_uring_enter consumed none of the queued operations: withdraw them, and leave them to the caller
+                    failed = true;
+                    __atomic_store_n(sq_tail, tail - queued, __ATOMIC_RELEASE);
+                    queued = 0;
+                }
+            } else {
+                queued -= ret;
+                in_flight += ret;
+            }
+            // Reap completions
+            unsigned head = *cq_head;
+            unsigned completed_tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            while (head != completed_tail) {
+                io_uring_cqe &cqe = cqes[head & *cq_mask];
+                complete(cqe.user_data, cqe.res);
+                ++head;
+                --in_flight;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        if (failed) {
+            release();
+        }
+    }
+
+    void transfer(int fd, unsigned char opcode, IoRequest *requests, std::size_t count) {
+        run(
+                count,
+                [&](io_uring_sqe &sqe, std::size_t i) {
+                    sqe.opcode = opcode;
+                    sqe.fd = fd;
+                    sqe.addr = (unsigned long) (requests[i].buffer + requests[i].done);
+                    sqe.len = (unsigned) (requests[i].size - requests[i].done);
+                    sqe.off = (unsigned long) (requests[i].offset + (long) requests[i].done);
+                },
+                [&](std::size_t i, int res) {
+                    if (res > 0) {
+                        requests[i].done += res;
+                    }
+                });
+    }
+
+    void transfer_vectored(int fd, unsigned char opcode, IoVectorRequest *requests, std::size_t count) {
+        run(
+                count,
+                [&](io_uring_sqe &sqe, std::size_t i) {
+                    sqe.opcode = opcode;
+                    sqe.fd = fd;
+                    sqe.addr = (unsigned long) requests[i].vector;
+                    sqe.len = (unsigned) requests[i].count;
+                    sqe.off = (unsigned long) requests[i].offset;
+                },
+                [&](std::size_t i, int res) {
+                    if (res > 0) {
+                        requests[i].done = res;
+                    }
+                });
+    }
+
+public:
+    explicit IoUring(unsigned queue_depth = 128) {
+        io_uring_params params{};
+        ring_fd = (int) ::syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (ring_fd < 0) {
+            ring_fd = -1;
+            return;
+        }
+        entries = params.sq_entries;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        void *address = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (address == MAP_FAILED) {
+            release();
+            return;
+        }
+        sq_ring = address;
+        if (single_mmap) {
+            cq_ring = sq_ring;
+        } else {
+            address = ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (address == MAP_FAILED) {
+                release();
+                return;
+            }
+            cq_ring = address;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        address = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (address == MAP_FAILED) {
+            release();
+            return;
+        }
+        sqes = (io_uring_sqe *) address;
+        char *sq = (char *) sq_ring;
+        char *cq = (char *) cq_ring;
+        sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + params.sq_off.array);
+        cq_head = (unsigned *) (cq + params.cq_off.head);
+        cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring &) = delete;
+
+    IoUring &operator=(const IoUring &) = delete;
+
+    bool is_available() const {
+        return ring_fd != -1;
+    }
+
+    /*
+     * Reads every request from `fd`. Failed or short reads keep done < size.
+     */
+    void read(int fd, IoRequest *requests, std::size_t count) {
+        if (is_available()) {
+            transfer(fd, IORING_OP_READ, requests, count);
+        }
+    }
+
+    /*
+     * Writes every request to `fd`. Failed or short writes keep done < size.
+     */
+    void write(int fd, IoRequest *requests, std::size_t count) {
+        if (is_available()) {
+            transfer(fd, IORING_OP_WRITE, requests, count);
+        }
+    }
+
+    /*
+     * Reads every vectored request from `fd` (one operation per request). Failed or short reads keep done < size.
+     */
+    void read_vectored(int fd, IoVectorRequest *requests, std::size_t count) {
+        if (is_available()) {
+            transfer_vectored(fd, IORING_OP_READV, requests, count);
+        }
+    }
+
+    /*
+     * Writes every vectored request to `fd` (one operation per request). Failed or short writes keep done < size.
+     */
+    void write_vectored(int fd, IoVectorRequest *requests, std::size_t count) {
+        if (is_available()) {
+            transfer_vectored(fd, IORING_OP_WRITEV, requests, count);
+        }
+    }
+
+    ~IoUring() {
+        release();
+    }
+};
+
+#else
+
+/*
+ * io_uring is not available on this platform: every batch is completed by the caller with pread/pwrite.
+ */
+class IoUring {
+public:
+    explicit IoUring(unsigned = 128) {}
+
+    bool is_available() const {
+        return false;
+    }
+
+    void read(int, IoRequest *, std::size_t) {}
+
+    void write(int, IoRequest *, std::size_t) {}
+
+    void read_vectored(int, IoVectorRequest *, std::size_t) {}
+
+    void write_vectored(int, IoVectorRequest *, std::size_t) {}
+};
+
+#endif
+
+
+#endif//EXTENDIBLE_HASH_IOURING_HPP
@@ -0,0 +1,284 @@
+#ifndef EXTENDIBLE_HASH_MAPPEDFILE_HPP
+#define EXTENDIBLE_HASH_MAPPEDFILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <cstring>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "DiskFile.hpp"
+
+/*
+ * File accessed through a shared memory mapping (reads and writes are plain copies), with the same interface as DiskFile.
+ * The mapping reserves more address space than the file needs, so the file can grow (ftruncate) without remapping on every append;
+ * only the bytes before the end of the file are ever accessed. When the reservation is exhausted, the file is mapped again with twice the space.
+ * The kernel writes the modified pages back; `sync` forces them to stable storage (msync).
+ * Reads and writes of different threads may run concurrently: they copy under a shared latch, and the mapping is only replaced under an exclusive one.
+ */
+class MappedFile {
+    int fd = -1;                      // < Underlying file descriptor (-1 when closed)
+    bool writable = false;            // < Is `true` if the file was opened for writing
+    char *mapping = nullptr;          // < Shared mapping of the file
+    std::size_t mapping_size = 0;     // < Address space reserved by the mapping (at least the size of the file)
+    long file_size = 0;               // < Size of the file in bytes
+    std::atomic<bool> unsynced{false};// < Is `true` if the file was modified since the last sync
+    mutable std::shared_mutex latch;  // < Shared while bytes are copied, exclusive while the size or the mapping change
+
+    void remap(std::size_t size) {
+        unmap_all();
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        size = std::max<std::size_t>((size + page_size - 1) / page_size * page_size, page_size);
+        void *address = ::mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            throw std::runtime_error("Could not map file.");
+        }
+        mapping = (char *) address;
+        mapping_size = size;
+    }
+
+    void unmap_all() {
+        if (mapping != nullptr) {
+            ::munmap(mapping, mapping_size);
+            mapping = nullptr;
+        }
+        mapping_size = 0;
+    }
+
+    /*
+     * Picks up the current size of the file, which may have been changed through another handle.
+     */
+    void update_size() {
+        file_size = size();
+        if ((std::size_t) file_size > mapping_size) {
+            remap(2 * (std::size_t) file_size);
+        }
+    }
+
+    void resize(long size) {
+        if (::ftruncate(fd, size) == -1) {
+            throw std::runtime_error("Could not truncate file.");
+        }
+        file_size = size;
+        unsynced = true;
+        if ((std::size_t) size > mapping_size) {
+            remap(2 * (std::size_t) size);
+        }
+    }
+
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    static bool exists(const std::string &file_name) {
+        return ::access(file_name.c_str(), F_OK) == 0;
+    }
+
+    /*
+     * Opens and maps a file, creating it if it does not exist. `direct_io` is ignored (a mapping always goes through the page cache).
+     * Throws an exception if the file could not be opened.
+     */
+    void open(const std::string &file_name, int flags = O_RDWR | O_CREAT, bool = false) {
+        close();
+        fd = ::open(file_name.c_str(), flags, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Could not open file.");
+        }
+        writable = (flags & O_ACCMODE) != O_RDONLY;
+        struct stat file_stat {};
+        if (::fstat(fd, &file_stat) == -1) {
+            throw std::runtime_error("Could not stat file.");
+        }
+        file_size = file_stat.st_size;
+        unsynced = false;
+        remap(2 * (std::size_t) file_size);
+    }
+
+    bool is_open() const {
+        return fd != -1;
+    }
+
+    bool is_direct() const {
+        return false;
+    }
+
+    void close() {
+        unmap_all();
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+        file_size = 0;
+    }
+
+    std::size_t read(char *buffer, std::size_t size, long offset) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        if (offset + (long) size > file_size) {
+            lock.unlock();
+            {
+                std::unique_lock<std::shared_mutex> exclusive_lock(latch);
+                update_size();
+            }
+            lock.lock();
+        }
+        if (offset >= file_size) {
+            return 0;
+        }
+        std::size_t available = std::min<std::size_t>(size, file_size - offset);
+        std::memcpy(buffer, mapping + offset, available);
+        return available;
+    }
+
+    void read_batch(std::vector<IoRequest> &requests) {
+        for (auto &request: requests) {
+            request.done = read(request.buffer, request.size, request.offset);
+        }
+    }
+
+    void read_coalesced(std::vector<IoRequest> &requests, std::size_t) {
+        read_batch(requests);
+    }
+
+    void write(const char *buffer, std::size_t size, long offset) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        if (offset + (long) size > file_size) {
+            lock.unlock();
+            {
+                std::unique_lock<std::shared_mutex> exclusive_lock(latch);
+                update_size();
+                if (offset + (long) size > file_size) {
+                    resize(offset + (long) size);
+                }
+            }
+            lock.lock();
+        }
+        std::memcpy(mapping + offset, buffer, size);
+        unsynced = true;
+    }
+
+    void write_vectored(const iovec *vector, int count, long offset) {
+        for (int i = 0; i < count; ++i) {
+            write((const char *) vector[i].iov_base, vector[i].iov_len, offset);
+            offset += (long) vector[i].iov_len;
+        }
+    }
+
+    void write_batch(std::vector<IoVectorRequest> &requests) {
+        for (auto &request: requests) {
+            write_vectored(request.vector, request.count, request.offset);
+            request.done = request.size;
+        }
+    }
+
+    long size() const {
+        struct stat file_stat {};
+        if (::fstat(fd, &file_stat) == -1) {
+            throw std::runtime_error("Could not stat file.");
+        }
+        return file_stat.st_size;
+    }
+
+    /*
+     * The file is always mapped: mapping only picks up its current size, as DiskFile::map does.
+     */
+    void map() {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        update_size();
+    }
+
+    void unmap() {}
+
+    bool is_mapped() const {
+        return mapping != nullptr;
+    }
+
+    const char *mapped(long offset, std::size_t size) const {
+        if (offset < 0 || offset + (long) size > file_size) {
+            throw std::runtime_error("Access outside of the mapped file.");
+        }
+        return mapping + offset;
+    }
+
+    void advise(AccessPattern pattern) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        int advice = MADV_NORMAL;
+        if (pattern == AccessPattern::Sequential) {
+            advice = MADV_SEQUENTIAL;
+        } else if (pattern == AccessPattern::Random) {
+            advice = MADV_RANDOM;
+        }
+        ::madvise(mapping, mapping_size, advice);
+    }
+
+    /*
+     * Returns, for every page of the range [offset, offset + length), whether it is currently cached in RAM.
+     */
+    std::vector<bool> cached_pages(long offset, long length) {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        std::vector<bool> cached((length + page_size - 1) / page_size, true);
+        long available = std::min(length, file_size - offset);
+        if (available <= 0) {
+            return cached;
+        }
+        std::vector<unsigned char> residency((available + page_size - 1) / page_size);
+        if (::mincore(mapping + offset, available, residency.data()) == 0) {
+            for (std::size_t i = 0; i < residency.size(); ++i) {
+                cached[i] = residency[i] & 1;
+            }
+        }
+        return cached;
+    }
+
+    void drop_cached_pages(long offset, long length, const std::vector<bool> &keep) {
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        std::size_t pages = (length + page_size - 1) / page_size;
+        for (std::size_t page = 0; page < pages; ++page) {
+            if (page >= keep.size() || !keep[page]) {
+                ::posix_fadvise(fd, offset + (long) page * page_size, page_size, POSIX_FADV_DONTNEED);
+            }
+        }
+    }
+
+    void preallocate(long offset, long length) {
+#ifdef FALLOC_FL_KEEP_SIZE
+        ::fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+    }
+
+    void truncate(long size) {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        resize(size);
+    }
+
+    void sync() {
+        if (!unsynced.exchange(false)) {
+            return;
+        }
+        std::shared_lock<std::shared_mutex> lock(latch);
+        if (file_size > 0 && ::msync(mapping, file_size, MS_SYNC) == -1) {
+            unsynced = true;
+            throw std::runtime_error("Could not sync file.");
+        }
+        ::fdatasync(fd);
+    }
+
+    ~MappedFile() {
+        close();
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_MAPPEDFILE_HPP
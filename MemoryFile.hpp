@@ -0,0 +1,227 @@
+#ifndef EXTENDIBLE_HASH_MEMORYFILE_HPP
+#define EXTENDIBLE_HASH_MEMORYFILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "DiskFile.hpp"
+
+/*
+ * File kept entirely in RAM, with the same interface as DiskFile.
+ * Contents are shared by every MemoryFile opened with the same name in the process, so an index can be closed and opened again.
+ * The first time a name is opened, the file of that name on disk is loaded if it exists (e.g. the raw data file).
+ * Nothing is ever written back to disk: the files of an index stored in memory are lost when the process exits.
+ * Reads and writes of different threads may run concurrently: they copy under a shared latch, and the bytes are only reallocated under an exclusive one.
+ */
+class MemoryFile {
+    struct Contents {
+        std::vector<char> bytes;        // < Bytes of the file
+        mutable std::shared_mutex latch;// < Shared while bytes are copied, exclusive while they are reallocated
+    };
+
+    std::shared_ptr<Contents> contents;// < Bytes of the file (nullptr when closed)
+
+    static std::mutex &registry_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<std::string, std::shared_ptr<Contents>> &registry() {
+        static std::map<std::string, std::shared_ptr<Contents>> files;
+        return files;
+    }
+
+    /*
+     * Loads the file `file_name` from disk. Returns nullptr if it does not exist.
+     */
+    static std::shared_ptr<Contents> load(const std::string &file_name) {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return nullptr;
+        }
+        auto loaded = std::make_shared<Contents>();
+        char buffer[64 * 1024];
+        ssize_t bytes;
+        while ((bytes = ::read(fd, buffer, sizeof(buffer))) != 0) {
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ::close(fd);
+                throw std::runtime_error("Could not read from file.");
+            }
+            loaded->bytes.insert(loaded->bytes.end(), buffer, buffer + bytes);
+        }
+        ::close(fd);
+        return loaded;
+    }
+
+public:
+    MemoryFile() = default;
+
+    MemoryFile(const MemoryFile &) = delete;
+
+    MemoryFile &operator=(const MemoryFile &) = delete;
+
+    /*
+     * Returns `true` if a file with this name is in memory or on disk.
+     */
+    static bool exists(const std::string &file_name) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        return registry().count(file_name) != 0 || ::access(file_name.c_str(), F_OK) == 0;
+    }
+
+    /*
+     * Frees the memory of the file `file_name` (files already open keep their contents until they are closed).
+     */
+    static void release(const std::string &file_name) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().erase(file_name);
+    }
+
+    /*
+     * Opens a file, creating it if it does not exist and `flags` contains O_CREAT. `direct_io` is ignored.
+     * Throws an exception if the file could not be opened.
+     */
+    void open(const std::string &file_name, int flags = O_RDWR | O_CREAT, bool = false) {
+        close();
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(file_name);
+        if (it == registry().end()) {
+            std::shared_ptr<Contents> loaded = load(file_name);
+            if (!loaded) {
+                if (!(flags & O_CREAT)) {
+                    throw std::runtime_error("Could not open file.");
+                }
+                loaded = std::make_shared<Contents>();
+            }
+            it = registry().emplace(file_name, loaded).first;
+        }
+        contents = it->second;
+        if (flags & O_TRUNC) {
+            std::unique_lock<std::shared_mutex> exclusive_lock(contents->latch);
+            contents->bytes.clear();
+        }
+    }
+
+    bool is_open() const {
+        return contents != nullptr;
+    }
+
+    bool is_direct() const {
+        return false;
+    }
+
+    void close() {
+        contents = nullptr;
+    }
+
+    std::size_t read(char *buffer, std::size_t size, long offset) {
+        std::shared_lock<std::shared_mutex> lock(contents->latch);
+        if (offset >= (long) contents->bytes.size()) {
+            return 0;
+        }
+        std::size_t available = std::min(size, contents->bytes.size() - offset);
+        std::memcpy(buffer, contents->bytes.data() + offset, available);
+        return available;
+    }
+
+    void read_batch(std::vector<IoRequest> &requests) {
+        for (auto &request: requests) {
+            request.done = read(request.buffer, request.size, request.offset);
+        }
+    }
+
+    void read_coalesced(std::vector<IoRequest> &requests, std::size_t) {
+        read_batch(requests);
+    }
+
+    void write(const char *buffer, std::size_t size, long offset) {
+        std::shared_lock<std::shared_mutex> lock(contents->latch);
+        if (offset + size > contents->bytes.size()) {
+            lock.unlock();
+            {
+                std::unique_lock<std::shared_mutex> exclusive_lock(contents->latch);
+                if (offset + size > contents->bytes.size()) {
+                    contents->bytes.resize(offset + size);
+                }
+            }
+            lock.lock();
+        }
+        std::memcpy(contents->bytes.data() + offset, buffer, size);
+    }
+
+    void write_vectored(const iovec *vector, int count, long offset) {
+        for (int i = 0; i < count; ++i) {
+            write((const char *) vector[i].iov_base, vector[i].iov_len, offset);
+            offset += (long) vector[i].iov_len;
+        }
+    }
+
+    void write_batch(std::vector<IoVectorRequest> &requests) {
+        for (auto &request: requests) {
+            write_vectored(request.vector, request.count, request.offset);
+            request.done = request.size;
+        }
+    }
+
+    long size() const {
+        std::shared_lock<std::shared_mutex> lock(contents->latch);
+        return (long) contents->bytes.size();
+    }
+
+    /*
+     * The contents are always in memory: mapping does nothing.
+     */
+    void map() {}
+
+    void unmap() {}
+
+    bool is_mapped() const {
+        return is_open();
+    }
+
+    const char *mapped(long offset, std::size_t size) const {
+        std::shared_lock<std::shared_mutex> lock(contents->latch);
+        if (offset < 0 || (std::size_t) offset + size > contents->bytes.size()) {
+            throw std::runtime_error("Access outside of the mapped file.");
+        }
+        return contents->bytes.data() + offset;
+    }
+
+    void advise(AccessPattern) {}
+
+    std::vector<bool> cached_pages(long, long length) {
+        long page_size = ::sysconf(_SC_PAGESIZE);
+        return std::vector<bool>((length + page_size - 1) / page_size, true);
+    }
+
+    void drop_cached_pages(long, long, const std::vector<bool> &) {}
+
+    void preallocate(long offset, long length) {
+        std::unique_lock<std::shared_mutex> lock(contents->latch);
+        contents->bytes.reserve(offset + length);
+    }
+
+    void truncate(long size) {
+        std::unique_lock<std::shared_mutex> lock(contents->latch);
+        contents->bytes.resize(size);
+    }
+
+    void sync() {}
+};
+
+
+#endif//EXTENDIBLE_HASH_MEMORYFILE_HPP
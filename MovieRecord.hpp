@@ -0,0 +1,35 @@
+#ifndef EXTENDIBLE_HASH_MOVIERECORD_HPP
+#define EXTENDIBLE_HASH_MOVIERECORD_HPP
+
+#include <sstream>
+#include <string>
+
+/*
+ * Fixed length record of the movies and series data file (database/movies_and_series.dat), written by ingest_data.
+ */
+struct MovieRecord {
+    int dataId{};
+    char contentType[16]{'\0'};
+    char title[256]{'\0'};
+    short length{};
+    short releaseYear{};
+    short endYear{};
+    int votes{};
+    float rating{};
+    int gross{};
+    char certificate[16]{'\0'};
+    char description[512]{'\0'};
+    bool removed{};
+
+    std::string to_string() {
+        std::stringstream ss;
+        ss << "("
+           << dataId << ", " << contentType << ", " << title << ", " << length << ", " << releaseYear << ", "
+           << endYear << ", " << votes << ", " << rating << ", " << gross << ", " << certificate
+           << ", " << std::boolalpha << removed << ")";
+        return ss.str();
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_MOVIERECORD_HPP
@@ -0,0 +1,184 @@
+#ifndef EXTENDIBLE_HASH_RECORDCACHE_HPP
+#define EXTENDIBLE_HASH_RECORDCACHE_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Number of independently locked shards of a record cache.
+ */
+
+#ifndef RECORD_CACHE_SHARDS
+#define RECORD_CACHE_SHARDS 16
+#endif
+
+/*
+ * Bounded cache of records of the raw data file, keyed by their physical position (record_ref).
+ * The cache is split in shards (chosen by record position), each one with its own lock, its own LRU list and an equal part of the byte budget,
+ * so concurrent lookups of different records seldom contend.
+ * A capacity of 0 bytes disables the cache.
+ * Every index of the same raw data file in a process shares one cache (see `shared`), so a record removed through one index
+ * is never served stale by another. Changes made to the raw data file by other processes are not seen.
+ * A record read from the raw data file while another thread modifies it could be cached after its invalidation:
+ * every shard counts its invalidations (its generation), and `put` only caches a record if no invalidation happened since it was read.
+ */
+template<typename RecordType>
+class RecordCache {
+    struct Entry {
+        long record_ref = 0;// < Position of the record in the raw data file
+        RecordType record{};// < Copy of the record
+    };
+
+    struct Shard {
+        std::mutex mutex;                                                       // < Protects the shard
+        std::list<Entry> entries;                                               // < Cached records, most recently used first
+        std::unordered_map<long, typename std::list<Entry>::iterator> positions;// < Maps a record_ref to its entry
+        std::size_t used = 0;                                                   // < Bytes charged to the cached records
+        std::size_t generation = 0;                                             // < Bumped by every invalidation of a record of the shard
+    };
+
+    // Bytes charged per record: the record plus the bookkeeping of the list and map nodes
+    static constexpr std::size_t ENTRY_SIZE = sizeof(Entry) + 6 * sizeof(void *);
+
+    std::vector<Shard> shards;     // < Independent parts of the cache
+    std::size_t shard_capacity = 0;// < Byte budget of each shard
+
+    Shard &shard_of(long record_ref) {
+        return shards[std::hash<long>{}(record_ref / (long) sizeof(RecordType)) % shards.size()];
+    }
+
+public:
+    explicit RecordCache(std::size_t capacity) : shards(RECORD_CACHE_SHARDS), shard_capacity(capacity / RECORD_CACHE_SHARDS) {}
+
+    RecordCache(const RecordCache &) = delete;
+
+    RecordCache &operator=(const RecordCache &) = delete;
+
+    /*
+     * Returns the cache of the raw data file `file_name`, shared by every index of that file in this process.
+     * The first index that asks for it sets its capacity.
+     */
+    static std::shared_ptr<RecordCache> shared(const std::string &file_name, std::size_t capacity) {
+        static std::mutex registry_mutex;
+        static std::map<std::string, std::weak_ptr<RecordCache>> registry;
+        // Different names of the same file must share the cache
+        std::string key = file_name;
+        if (char *path = ::realpath(file_name.c_str(), nullptr)) {
+            key = path;
+            std::free(path);
+        }
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::shared_ptr<RecordCache> cache = registry[key].lock();
+        if (!cache) {
+            cache = std::make_shared<RecordCache>(capacity);
+            registry[key] = cache;
+        }
+        return cache;
+    }
+
+    bool is_enabled() const {
+        return shard_capacity >= ENTRY_SIZE;
+    }
+
+    /*
+     * Copies the record at position record_ref into `record` if it is cached.
+     * Returns `true` on a hit.
+     */
+    bool get(long record_ref, RecordType &record) {
+        if (!is_enabled()) {
+            return false;
+        }
+        Shard &shard = shard_of(record_ref);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.positions.find(record_ref);
+        if (it == shard.positions.end()) {
+            return false;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        record = it->second->record;
+        return true;
+    }
+
+    /*
+     * Returns the generation of the shard of the record at position record_ref, to be taken before reading the record
+     * from the raw data file and given back to `put`.
+     */
+    std::size_t generation(long record_ref) {
+        if (!is_enabled()) {
+            return 0;
+        }
+        Shard &shard = shard_of(record_ref);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.generation;
+    }
+
+    /*
+     * Caches a copy of the record at position record_ref, evicting the least recently used records of its shard if needed.
+     * `generation` is the generation of its shard before the record was read (see `generation`): if a record of the shard
+     * was invalidated since then, the copy may predate the change and it's not cached.
+     */
+    void put(long record_ref, const RecordType &record, std::size_t generation) {
+        if (!is_enabled()) {
+            return;
+        }
+        Shard &shard = shard_of(record_ref);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.generation != generation) {
+            return;
+        }
+        auto it = shard.positions.find(record_ref);
+        if (it != shard.positions.end()) {
+            it->second->record = record;
+            shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+            return;
+        }
+        while (shard.used + ENTRY_SIZE > shard_capacity) {
+            shard.positions.erase(shard.entries.back().record_ref);
+            shard.entries.pop_back();
+            shard.used -= ENTRY_SIZE;
+        }
+        shard.entries.push_front(Entry{record_ref, record});
+        shard.positions[record_ref] = shard.entries.begin();
+        shard.used += ENTRY_SIZE;
+    }
+
+    /*
+     * Drops the record at position record_ref (e.g. because it was modified in the raw data file),
+     * and bumps the generation of its shard so that copies read before the change are not cached.
+     */
+    void invalidate(long record_ref) {
+        if (!is_enabled()) {
+            return;
+        }
+        Shard &shard = shard_of(record_ref);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ++shard.generation;
+        auto it = shard.positions.find(record_ref);
+        if (it != shard.positions.end()) {
+            shard.entries.erase(it->second);
+            shard.positions.erase(it);
+            shard.used -= ENTRY_SIZE;
+        }
+    }
+
+    void clear() {
+        for (auto &shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.positions.clear();
+            shard.used = 0;
+            ++shard.generation;
+        }
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_RECORDCACHE_HPP
@@ -0,0 +1,82 @@
+#ifndef EXTENDIBLE_HASH_SCANCACHE_HPP
+#define EXTENDIBLE_HASH_SCANCACHE_HPP
+
+#include <deque>
+#include <vector>
+
+/*
+ * Size of the windows (in bytes, multiple of the page size) in which a full scan of the raw data file releases the pages it brought to the page cache.
+ */
+
+#ifndef SCAN_CACHE_WINDOW
+#define SCAN_CACHE_WINDOW (16 * 1024 * 1024)
+#endif
+
+/*
+ * How far (in bytes) past the end of a read of a sequential scan the readahead of the kernel may bring pages to the page cache.
+ * Linux reads ahead up to twice read_ahead_kb with POSIX_FADV_SEQUENTIAL, and keeps an asynchronous window beyond that.
+ */
+
+#ifndef SCAN_READAHEAD_LIMIT
+#define SCAN_READAHEAD_LIMIT (64 * 1024 * 1024)
+#endif
+
+/*
+ * Releases the pages a sequential scan of a file brings to the page cache, window by window (SCAN_CACHE_WINDOW bytes),
+ * keeping the pages that were already cached (e.g. the working set of searches).
+ * Which pages of a window were cached is recorded before any read of the scan can bring them in: `before_read` records every window
+ * up to SCAN_READAHEAD_LIMIT bytes past the end of the read (as far as its readahead may reach), and `after_read` drops the windows the scan has passed.
+ * `File` is the storage backend of the scanned file (see `cached_pages` and `drop_cached_pages`).
+ */
+template<typename File>
+class ScanCache {
+    struct Window {
+        long start = 0;              // < Position of the window in the file
+        std::vector<bool> was_cached;// < Pages of the window cached before the scan
+    };
+
+    File &file;                // < Scanned file
+    std::deque<Window> windows;// < Windows recorded and not dropped yet, in order
+    long recorded_end;         // < End of the last window recorded
+
+public:
+    // Scan starting at position `start` of `file`
+    ScanCache(File &file, long start) : file(file), recorded_end(start / SCAN_CACHE_WINDOW * SCAN_CACHE_WINDOW) {}
+
+    ScanCache(const ScanCache &) = delete;
+
+    ScanCache &operator=(const ScanCache &) = delete;
+
+    /*
+     * Records the windows a read of the scan ending at position `end` (or its readahead) may bring to the page cache.
+     */
+    void before_read(long end) {
+        while (recorded_end < end + SCAN_READAHEAD_LIMIT) {
+            windows.push_back(Window{recorded_end, file.cached_pages(recorded_end, SCAN_CACHE_WINDOW)});
+            recorded_end += SCAN_CACHE_WINDOW;
+        }
+    }
+
+    /*
+     * Drops the pages the scan brought in of every window it has read completely (up to position `end`).
+     */
+    void after_read(long end) {
+        while (!windows.empty() && windows.front().start + SCAN_CACHE_WINDOW <= end) {
+            file.drop_cached_pages(windows.front().start, SCAN_CACHE_WINDOW, windows.front().was_cached);
+            windows.pop_front();
+        }
+    }
+
+    /*
+     * Drops the pages the scan (and its readahead) brought in of the windows left, once the scan is over.
+     */
+    void finish() {
+        for (auto &window: windows) {
+            file.drop_cached_pages(window.start, SCAN_CACHE_WINDOW, window.was_cached);
+        }
+        windows.clear();
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_SCANCACHE_HPP
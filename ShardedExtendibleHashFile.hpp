@@ -0,0 +1,191 @@
+#ifndef EXTENDIBLE_HASH_SHARDEDEXTENDIBLEHASHFILE_HPP
+#define EXTENDIBLE_HASH_SHARDEDEXTENDIBLEHASHFILE_HPP
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DiskFile.hpp"
+#include "ExtendibleHashFile.hpp"
+#include "ExtendibleHashIndexSet.hpp"
+
+/*
+ * Amount of highest bits of the hash that route keys to the shards of an index by default: 3 bits, that is 2^3 = 8 shards.
+ */
+
+#ifndef SHARD_BITS
+#define SHARD_BITS 3
+#endif
+
+/*
+ * Index made of 2^shard_bits independent extendible hashes (shards), each with its own directory, hash file, buffer pool and latches.
+ * Keys are routed to a shard by the highest bits of their hash (see func::shard_of), and placed in its buckets by the lowest bits,
+ * as a single index would. Since the shards share nothing, inserts of keys of different shards run in parallel,
+ * and a split, a new overflow bucket or a checkpoint of a shard never stalls the others.
+ * The buffer pool and build memory given in the options are divided among the shards, and so are the build and search threads:
+ * every shard is built in its own thread, from a single scan of the raw data file (see ExtendibleHashIndexSet).
+ * The files of shard i are named after `<uniqueId>_shard<i>` (e.g. movies.dat_release_year_shard3.ehash).
+ */
+template<typename KeyType,
+         typename RecordType,
+         std::size_t global_depth = 16,                        // < Maximum depth of the binary index key of every shard (defaults to 16)
+         typename Index = std::function<KeyType(RecordType &)>,// < Indexing function type
+         typename Equal = std::equal_to<KeyType>,              // < Equal comparator type
+         typename Hash = std::hash<KeyType>,                   // < Hash type
+         typename File = DiskFile                              // < Storage backend of the files (DiskFile, MemoryFile or MappedFile)
+         >
+class ShardedExtendibleHashFile {
+    using Shard = ExtendibleHashFile<KeyType, RecordType, global_depth, Index, Equal, Hash, File>;
+
+    std::string raw_file_name;                 // < Raw data file name
+    Index index;                               // < Receives a `RecordType` and returns his `KeyType` associated
+    Hash hash_function;                        // < Hash function
+    std::size_t shard_bits;                    // < Highest bits of the hash that route keys to shards
+    std::vector<std::unique_ptr<Shard>> shards;// < Independent index of every shard
+
+    std::size_t shard_position(KeyType key) {
+        return func::shard_of(hash_function(key), shard_bits);
+    }
+
+public:
+    /*
+     * Constructor. Takes the parameters of ExtendibleHashFile, plus the amount of highest bits of the hash that route keys to shards.
+     */
+    explicit ShardedExtendibleHashFile(const std::string &fileName, const std::string &uniqueId, bool primaryKey, Index index, Equal equal = std::equal_to<KeyType>{}, Hash hash = std::hash<KeyType>{}, ExtendibleHashOptions options = {}, std::size_t shard_bits = SHARD_BITS) : raw_file_name(fileName), index(index), hash_function(hash), shard_bits(shard_bits) {
+        std::size_t shard_count = (std::size_t) 1 << shard_bits;
+        options.shard_bits = shard_bits;
+        options.buffer_pool_size /= shard_count;
+        options.build_memory_size /= shard_count;
+        options.build_threads = std::max<std::size_t>(1, options.build_threads / shard_count);
+        options.search_threads = std::max<std::size_t>(1, options.search_threads / shard_count);
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            options.shard = i;
+            shards.push_back(std::make_unique<Shard>(fileName, uniqueId + "_shard" + std::to_string(i), primaryKey, index, equal, hash, options));
+        }
+    }
+
+    ShardedExtendibleHashFile(const ShardedExtendibleHashFile &) = delete;
+
+    ShardedExtendibleHashFile &operator=(const ShardedExtendibleHashFile &) = delete;
+
+    /*
+     * Returns a bool that indicates whether every shard has already been created.
+     */
+    explicit operator bool() {
+        return std::all_of(shards.begin(), shards.end(), [](std::unique_ptr<Shard> &shard) {
+            return (bool) *shard;
+        });
+    }
+
+    std::size_t shard_count() const {
+        return shards.size();
+    }
+
+    /*
+     * Constructs every shard reading the raw data file once: each shard is built in its own thread (see ExtendibleHashIndexSet),
+     * from the records whose keys are routed to it.
+     * Accesses to disk: O(n) where n is the total number of records in the data file (one sequential read for all the shards)
+     */
+    void create_index() {
+        ExtendibleHashIndexSet<RecordType, File> index_set{raw_file_name};
+        for (auto &shard: shards) {
+            index_set.add(*shard);
+        }
+        index_set.create_indexes();
+    }
+
+    /*
+     * Indexes the records appended to the raw data file in every shard (see ExtendibleHashFile::catch_up).
+     */
+    void catch_up() {
+        for (auto &shard: shards) {
+            shard->catch_up();
+        }
+    }
+
+    /*
+     * Returns the high-water mark of the shard that lags the most: every record before this position of the raw data file is indexed.
+     */
+    long indexed_size() {
+        long indexed_end = shards.front()->indexed_size();
+        for (auto &shard: shards) {
+            indexed_end = std::min(indexed_end, shard->indexed_size());
+        }
+        return indexed_end;
+    }
+
+    /*
+     * Searches a given key in its shard (see ExtendibleHashFile::search).
+     */
+    std::vector<RecordType> search(KeyType key) {
+        return shards[shard_position(key)]->search(key);
+    }
+
+    /*
+     * Searches several keys at once: the keys of every shard are searched together (see ExtendibleHashFile::search_many).
+     * Returns, for every key (in the same order), the elements that match it.
+     */
+    std::vector<std::vector<RecordType>> search_many(KeyType *keys, std::size_t count) {
+        // Positions of the keys of every shard
+        std::vector<std::vector<std::size_t>> positions(shards.size());
+        for (std::size_t i = 0; i < count; ++i) {
+            positions[shard_position(keys[i])].push_back(i);
+        }
+        std::vector<std::vector<RecordType>> result(count);
+        for (std::size_t s = 0; s < shards.size(); ++s) {
+            if (positions[s].empty()) {
+                continue;
+            }
+            std::unique_ptr<KeyType[]> shard_keys(new KeyType[positions[s].size()]);
+            for (std::size_t j = 0; j < positions[s].size(); ++j) {
+                func::copy(shard_keys[j], keys[positions[s][j]]);
+            }
+            std::vector<std::vector<RecordType>> found = shards[s]->search_many(shard_keys.get(), positions[s].size());
+            for (std::size_t j = 0; j < positions[s].size(); ++j) {
+                result[positions[s][j]] = std::move(found[j]);
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::vector<RecordType>> search_many(std::vector<KeyType> &keys) {
+        return search_many(keys.data(), keys.size());
+    }
+
+    /*
+     * Inserts a record in the shard of its key (see ExtendibleHashFile::insert).
+     */
+    void insert(RecordType &record, const long &record_ref) {
+        shards[shard_position(index(record))]->insert(record, record_ref);
+    }
+
+    /*
+     * Removes every record that matches the given key (see ExtendibleHashFile::remove).
+     */
+    void remove(KeyType key) {
+        shards[shard_position(key)]->remove(key);
+    }
+
+    void flush() {
+        for (auto &shard: shards) {
+            shard->flush();
+        }
+    }
+
+    void checkpoint() {
+        for (auto &shard: shards) {
+            shard->checkpoint();
+        }
+    }
+
+    void commit() {
+        for (auto &shard: shards) {
+            shard->commit();
+        }
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_SHARDEDEXTENDIBLEHASHFILE_HPP
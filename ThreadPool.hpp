@@ -0,0 +1,90 @@
+#ifndef EXTENDIBLE_HASH_THREADPOOL_HPP
+#define EXTENDIBLE_HASH_THREADPOOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads that run the tasks submitted to them, in submission order.
+ * The result (or exception) of a task is delivered through the future returned by `submit`.
+ * On destruction, the tasks that have not started are dropped (their futures report a broken promise) and the running ones are waited for.
+ */
+class ThreadPool {
+    std::mutex mutex;                       // < Protects the queue
+    std::condition_variable available;      // < Signals new tasks and the destruction of the pool
+    std::deque<std::function<void()>> tasks;// < Tasks not started yet
+    bool stopping = false;                  // < Tells the workers to exit
+    std::vector<std::thread> workers;       // < Threads that run the tasks
+
+    void run_worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            available.wait(lock, [this] {
+                return stopping || !tasks.empty();
+            });
+            if (stopping) {
+                return;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+public:
+    explicit ThreadPool(std::size_t threads) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+            workers.emplace_back(&ThreadPool::run_worker, this);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    std::size_t size() const {
+        return workers.size();
+    }
+
+    /*
+     * Queues `task()` to be run by a worker. Returns the future of its result.
+     */
+    template<typename Task>
+    auto submit(Task task) -> std::future<decltype(task())> {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([packaged] {
+                (*packaged)();
+            });
+        }
+        available.notify_one();
+        return result;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            tasks.clear();
+        }
+        available.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_THREADPOOL_HPP
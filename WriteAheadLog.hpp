@@ -0,0 +1,187 @@
+#ifndef EXTENDIBLE_HASH_WRITEAHEADLOG_HPP
+#define EXTENDIBLE_HASH_WRITEAHEADLOG_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DiskFile.hpp"
+
+/*
+ * Files whose contents are redone from the log.
+ */
+enum class LogTarget : std::uint32_t {
+    HashFile, // < Buckets (.ehash)
+    Directory,// < Directory entries (.ehashdir)
+    RawFile   // < Records of the raw data file
+};
+
+/*
+ * Redo-only write-ahead log of physical after-images.
+ * Every operation is appended as a single frame holding the new contents of each range of bytes it modified.
+ * A frame carries its size and a CRC-32 of its contents, so a frame torn by a crash is detected and ignored on recovery,
+ * which makes every operation atomic: either all of its writes are redone or none of them.
+ * Redoing a frame is idempotent (it only overwrites ranges with their final contents), so recovery can be repeated safely.
+ * `File` is the storage backend of the log (DiskFile, MemoryFile or MappedFile).
+ * The log may be synced by any thread (e.g. by the buffer pool before it writes a bucket back) while another one appends to it.
+ */
+template<typename File = DiskFile>
+class WriteAheadLog {
+    struct FrameHeader {
+        std::uint32_t magic = 0;   // < Marks the start of a frame
+        std::uint32_t checksum = 0;// < CRC-32 of the payload
+        std::uint64_t size = 0;    // < Size of the payload in bytes
+    };
+
+    struct EntryHeader {
+        LogTarget target = LogTarget::HashFile;// < File the bytes belong to
+        std::uint32_t size = 0;                // < Amount of bytes that follow the header
+        std::int64_t offset = 0;               // < Position of the bytes in the target file
+    };
+
+    static constexpr std::uint32_t FRAME_MAGIC = 0x57414c31;// < "WAL1"
+
+    File file;                // < Log file
+    long end = 0;             // < Position where the next frame will be appended
+    long synced_end = 0;      // < Frames before this position are on stable storage
+    std::vector<char> payload;// < Entries of the frame being built
+    mutable std::mutex mutex; // < Protects the log
+
+    static std::uint32_t crc32(const char *data, std::size_t size) {
+        static const std::vector<std::uint32_t> table = [] {
+            std::vector<std::uint32_t> values(256);
+            for (std::uint32_t i = 0; i < 256; ++i) {
+                std::uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+                }
+                values[i] = value;
+            }
+            return values;
+        }();
+        std::uint32_t crc = 0xFFFFFFFFu;
+        for (std::size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ (unsigned char) data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+public:
+    WriteAheadLog() = default;
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    /*
+     * Opens (or creates) the log file. New frames are appended after the existing ones, which must be redone first.
+     */
+    void open(const std::string &file_name) {
+        file.open(file_name);
+        end = synced_end = file.size();
+    }
+
+    bool is_open() const {
+        return file.is_open();
+    }
+
+    /*
+     * Size of the log in bytes.
+     */
+    long size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return end;
+    }
+
+    /*
+     * Adds the after-image of `size` bytes at position `offset` of `target` to the frame being built.
+     */
+    void add(LogTarget target, long offset, const char *data, std::size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        EntryHeader header{target, (std::uint32_t) size, offset};
+        payload.insert(payload.end(), (const char *) &header, (const char *) &header + sizeof(header));
+        payload.insert(payload.end(), data, data + size);
+    }
+
+    /*
+     * Appends the frame built so far with a single sequential write. Does nothing if the frame is empty.
+     * The frame reaches stable storage on the next `sync`.
+     */
+    void append() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (payload.empty()) {
+            return;
+        }
+        FrameHeader header{FRAME_MAGIC, crc32(payload.data(), payload.size()), payload.size()};
+        iovec vector[2] = {{&header, sizeof(header)}, {payload.data(), payload.size()}};
+        file.write_vectored(vector, 2, end);
+        end += (long) (sizeof(header) + payload.size());
+        payload.clear();
+    }
+
+    /*
+     * Forces the appended frames to stable storage (nothing is done if they already are).
+     */
+    void sync() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (synced_end != end) {
+            file.sync();
+            synced_end = end;
+        }
+    }
+
+    /*
+     * Calls `apply(target, offset, data, size)` for every entry of every complete frame, in log order.
+     * Stops at the first frame that is incomplete or corrupted (the tail torn by a crash).
+     * Returns the amount of frames redone.
+     */
+    template<typename Apply>
+    std::size_t replay(Apply apply) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::size_t frames = 0;
+        long position = 0;
+        long file_size = file.size();
+        std::vector<char> frame;
+        FrameHeader header{};
+        while (position + (long) sizeof(header) <= file_size) {
+            file.read((char *) &header, sizeof(header), position);
+            if (header.magic != FRAME_MAGIC || header.size > (std::uint64_t) (file_size - position - (long) sizeof(header))) {
+                break;
+            }
+            frame.resize(header.size);
+            if (file.read(frame.data(), frame.size(), position + (long) sizeof(header)) != frame.size() || crc32(frame.data(), frame.size()) != header.checksum) {
+                break;
+            }
+            std::size_t offset = 0;
+            while (offset + sizeof(EntryHeader) <= frame.size()) {
+                EntryHeader entry{};
+                std::memcpy(&entry, frame.data() + offset, sizeof(entry));
+                offset += sizeof(entry);
+                apply(entry.target, (long) entry.offset, frame.data() + offset, (std::size_t) entry.size);
+                offset += entry.size;
+            }
+            position += (long) (sizeof(header) + header.size);
+            ++frames;
+        }
+        return frames;
+    }
+
+    /*
+     * Empties the log (once every frame has been applied to the files and they are on stable storage).
+     * The truncation is synced before any frame is appended again: if a crash lost it, the new frames would overwrite the old ones
+     * from the start, and the old frames past them (still with valid checksums) would be redone after the new ones, reverting their changes.
+     */
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        payload.clear();
+        file.truncate(0);
+        file.sync();
+        end = synced_end = 0;
+    }
+};
+
+
+#endif//EXTENDIBLE_HASH_WRITEAHEADLOG_HPP
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DiskFile.hpp"
+#include "ExtendibleHashFile.hpp"
+#include "ExtendibleHashIndexSet.hpp"
+#include "MovieRecord.hpp"
+#include "ThreadPool.hpp"
+
+/*
+ * Size (in bytes) of the chunks in which the CSV files are read and handed to the parsing threads.
+ */
+
+#ifndef INGEST_CHUNK_SIZE
+#define INGEST_CHUNK_SIZE (8 * 1024 * 1024)
+#endif
+
+/*
+ * Attributes of a MovieRecord a CSV column can be mapped to.
+ */
+enum class MovieField {
+    None,// < Column not stored
+    DataId,
+    ContentType,
+    Title,
+    Length,
+    ReleaseYear,
+    EndYear,
+    Votes,
+    Rating,
+    Gross,
+    Certificate,
+    Description
+};
+
+/*
+ * Maps a column of the header to the attribute with the same name, ignoring case, spaces and underscores
+ * (e.g. "release_year" or "Release Year" to releaseYear).
+ */
+MovieField field_of(const std::string &column) {
+    std::string name;
+    for (char c: column) {
+        if (std::isalnum((unsigned char) c)) {
+            name += (char) std::tolower((unsigned char) c);
+        }
+    }
+    const std::pair<const char *, MovieField> fields[] = {
+            {"dataid", MovieField::DataId},
+            {"contenttype", MovieField::ContentType},
+            {"title", MovieField::Title},
+            {"length", MovieField::Length},
+            {"releaseyear", MovieField::ReleaseYear},
+            {"endyear", MovieField::EndYear},
+            {"votes", MovieField::Votes},
+            {"rating", MovieField::Rating},
+            {"gross", MovieField::Gross},
+            {"certificate", MovieField::Certificate},
+            {"description", MovieField::Description}};
+    for (auto &[field_name, field]: fields) {
+        if (name == field_name) {
+            return field;
+        }
+    }
+    return MovieField::None;
+}
+
+/*
+ * Reads the next row of CSV text starting at `position` (RFC 4180: quoted fields may hold commas, newlines and doubled quotes).
+ * Returns `false` if there are no more rows.
+ */
+bool next_row(const std::string &text, std::size_t &position, std::vector<std::string> &fields) {
+    fields.clear();
+    if (position >= text.size()) {
+        return false;
+    }
+    std::string field;
+    bool quoted = false;
+    while (position < text.size()) {
+        char c = text[position++];
+        if (quoted) {
+            if (c != '"') {
+                field += c;
+            } else if (position < text.size() && text[position] == '"') {
+                field += '"';
+                ++position;
+            } else {
+                quoted = false;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(std::move(field));
+            field.clear();
+        } else if (c == '\n') {
+            break;
+        } else if (c != '\r') {
+            field += c;
+        }
+    }
+    fields.push_back(std::move(field));
+    return true;
+}
+
+template<std::size_t N>
+void copy_text(char (&destination)[N], const std::string &text) {
+    std::size_t size = std::min(text.size(), N - 1);
+    std::memcpy(destination, text.data(), size);
+    destination[size] = '\0';
+}
+
+/*
+ * Empty or malformed numbers are stored as -1 (e.g. an unknown release year).
+ */
+template<typename T>
+T parse_number(const std::string &text) {
+    char *end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (text.empty() || end == text.c_str()) {
+        return (T) -1;
+    }
+    return (T) value;
+}
+
+void set_field(MovieRecord &record, MovieField field, const std::string &value) {
+    switch (field) {
+        case MovieField::DataId:
+            record.dataId = parse_number<int>(value);
+            break;
+        case MovieField::ContentType:
+            copy_text(record.contentType, value);
+            break;
+        case MovieField::Title:
+            copy_text(record.title, value);
+            break;
+        case MovieField::Length:
+            record.length = parse_number<short>(value);
+            break;
+        case MovieField::ReleaseYear:
+            record.releaseYear = parse_number<short>(value);
+            break;
+        case MovieField::EndYear:
+            record.endYear = parse_number<short>(value);
+            break;
+        case MovieField::Votes:
+            record.votes = parse_number<int>(value);
+            break;
+        case MovieField::Rating:
+            record.rating = parse_number<float>(value);
+            break;
+        case MovieField::Gross:
+            record.gross = parse_number<int>(value);
+            break;
+        case MovieField::Certificate:
+            copy_text(record.certificate, value);
+            break;
+        case MovieField::Description:
+            copy_text(record.description, value);
+            break;
+        case MovieField::None:
+            break;
+    }
+}
+
+/*
+ * Parses whole rows of CSV text into records, mapping the i-th field of every row to schema[i]. Blank lines are skipped.
+ */
+std::vector<MovieRecord> parse_rows(const std::string &text, const std::vector<MovieField> &schema) {
+    std::vector<MovieRecord> records;
+    std::vector<std::string> fields;
+    std::size_t position = 0;
+    while (next_row(text, position, fields)) {
+        if (fields.size() == 1 && fields[0].empty()) {
+            continue;
+        }
+        MovieRecord record{};
+        for (std::size_t i = 0; i < fields.size() && i < schema.size(); ++i) {
+            set_field(record, schema[i], fields[i]);
+        }
+        records.push_back(record);
+    }
+    return records;
+}
+
+/*
+ * Estimates the amount of rows of the CSV files from the average length of the rows of the first chunk of the first file.
+ * Returns 0 if there are no rows to measure.
+ */
+std::size_t estimate_rows(const std::vector<std::string> &csv_file_names) {
+    std::size_t total_size = 0;
+    for (auto &csv_file_name: csv_file_names) {
+        std::ifstream csv_file(csv_file_name, std::ios::binary | std::ios::ate);
+        if (csv_file) {
+            total_size += (std::size_t) csv_file.tellg();
+        }
+    }
+    std::ifstream csv_file(csv_file_names.front(), std::ios::binary);
+    std::string header;
+    std::getline(csv_file, header);
+    std::string text(INGEST_CHUNK_SIZE, '\0');
+    csv_file.read(&text[0], (std::streamsize) text.size());
+    text.resize(csv_file.gcount());
+    std::size_t rows = 0;
+    std::size_t measured = 0;
+    std::size_t position = 0;
+    std::vector<std::string> fields;
+    while (next_row(text, position, fields)) {
+        // The last row may be cut by the end of the chunk, and is not measured
+        if (position == text.size() && csv_file) {
+            break;
+        }
+        ++rows;
+        measured = position;
+    }
+    if (rows == 0) {
+        return 0;
+    }
+    return total_size / std::max<std::size_t>(1, measured / rows);
+}
+
+/*
+ * Streams CSV files into a fixed length data file of MovieRecord.
+ * Every file is read sequentially in chunks of INGEST_CHUNK_SIZE bytes, cut at the last row boundary (a newline outside quotes;
+ * the rest is carried to the next chunk, and a chunk without a boundary is carried whole), and the chunks are parsed in parallel by a thread pool.
+ * The parsed chunks are written in order, each with a single sequential write,
+ * and handed to `emit(records, count)` (e.g. to build indexes in the same pass, see ExtendibleHashIndexSet).
+ * If the CSV files have no dataId column, records are numbered in the order they are written, starting after the records already in the file.
+ * Returns the amount of records written.
+ */
+template<typename Emit>
+long ingest(const std::vector<std::string> &csv_file_names, DiskFile &data_file, Emit emit) {
+    ThreadPool pool(std::thread::hardware_concurrency());
+    long record_ref = data_file.size() / (long) sizeof(MovieRecord) * (long) sizeof(MovieRecord);
+    long written = 0;
+    for (auto &csv_file_name: csv_file_names) {
+        std::ifstream csv_file(csv_file_name, std::ios::binary);
+        if (!csv_file) {
+            throw std::runtime_error("Could not open CSV file " + csv_file_name + ".");
+        }
+        // The header maps every column to an attribute
+        std::string header;
+        std::getline(csv_file, header);
+        std::vector<std::string> columns;
+        std::size_t position = 0;
+        next_row(header, position, columns);
+        auto schema = std::make_shared<std::vector<MovieField>>();
+        for (auto &column: columns) {
+            schema->push_back(field_of(column));
+        }
+        bool numbered = std::find(schema->begin(), schema->end(), MovieField::DataId) == schema->end();
+        std::deque<std::future<std::vector<MovieRecord>>> parsing;
+        auto write_parsed = [&] {
+            std::vector<MovieRecord> records = parsing.front().get();
+            parsing.pop_front();
+            for (auto &record: records) {
+                if (numbered) {
+                    record.dataId = (int) (record_ref / (long) sizeof(MovieRecord)) + 1;
+                }
+                record_ref += sizeof(MovieRecord);
+            }
+            if (!records.empty()) {
+                data_file.write((const char *) records.data(), records.size() * sizeof(MovieRecord), record_ref - (long) (records.size() * sizeof(MovieRecord)));
+                emit(records.data(), records.size());
+                written += (long) records.size();
+            }
+        };
+        std::string pending;
+        bool quoted = false;
+        std::vector<char> buffer(INGEST_CHUNK_SIZE);
+        while (csv_file) {
+            csv_file.read(buffer.data(), (std::streamsize) buffer.size());
+            std::size_t size = csv_file.gcount();
+            // Cut the chunk after the last newline that is not inside a quoted field
+            std::size_t boundary = 0;
+            for (std::size_t i = 0; i < size; ++i) {
+                if (buffer[i] == '"') {
+                    quoted = !quoted;
+                } else if (buffer[i] == '\n' && !quoted) {
+                    boundary = i + 1;
+                }
+            }
+            // A row longer than the chunk: carry the whole chunk until its end is read (or the file ends)
+            if (boundary == 0 && csv_file) {
+                pending.append(buffer.data(), size);
+                continue;
+            }
+            if (!csv_file) {
+                boundary = size;
+            }
+            auto text = std::make_shared<std::string>(std::move(pending));
+            text->append(buffer.data(), boundary);
+            pending.assign(buffer.data() + boundary, size - boundary);
+            parsing.push_back(pool.submit([text, schema] {
+                return parse_rows(*text, *schema);
+            }));
+            // Bound the chunks waiting to be written
+            while (parsing.size() > 2 * pool.size()) {
+                write_parsed();
+            }
+        }
+        while (!parsing.empty()) {
+            write_parsed();
+        }
+    }
+    return written;
+}
+
+int main(int argc, char **argv) {
+    bool append = false;
+    bool create_indexes = false;
+    std::vector<std::string> file_names;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--append") {
+            append = true;
+        } else if (argument == "--index") {
+            create_indexes = true;
+        } else {
+            file_names.push_back(argument);
+        }
+    }
+    if (file_names.size() < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--append] [--index] <data file> <CSV file>..." << std::endl;
+        std::cerr << "Writes the rows of the CSV files as MovieRecord to the data file (e.g. database/movies_and_series.dat)." << std::endl;
+        std::cerr << "--append keeps the records already in the data file, --index also builds (or catches up) the indexes of main." << std::endl;
+        return 1;
+    }
+    std::string path_to_file = file_names[0];
+    std::vector<std::string> csv_file_names(file_names.begin() + 1, file_names.end());
+
+    constexpr std::size_t global_depth = 16;
+    std::function<int(MovieRecord &)> release_year_index = [=](MovieRecord &record) {
+        return record.releaseYear;
+    };
+    std::function<bool(char[16], char[16])> equal = [](char a[16], char b[16]) -> bool {
+        return std::string(a) == std::string(b);
+    };
+    std::function<char *(MovieRecord &)> content_type_index = [=](MovieRecord &record) {
+        return record.contentType;
+    };
+    std::hash<std::string> hasher;
+    std::function<std::size_t(char[16])> hash = [&hasher](char key[16]) {
+        return hasher(std::string(key));
+    };
+    std::function<int(MovieRecord &)> data_id_index = [=](MovieRecord &record) {
+        return record.dataId;
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    long written = 0;
+    try {
+        DiskFile data_file;
+        data_file.open(path_to_file, append ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC);
+        if (!create_indexes) {
+            written = ingest(csv_file_names, data_file, [](const MovieRecord *, std::size_t) {});
+        } else {
+            ExtendibleHashFile<int, MovieRecord, global_depth> extendible_hash_release_year{path_to_file, "release_year", false, release_year_index};
+            ExtendibleHashFile<char[16], MovieRecord, global_depth, std::function<char *(MovieRecord &)>, std::function<bool(char[16], char[16])>, std::function<std::size_t(char[16])>> extendible_hash_content_type{path_to_file, "content_type", false, content_type_index, equal, hash};
+            ExtendibleHashFile<int, MovieRecord, global_depth> extendible_hash_data_id{path_to_file, "data_id", true, data_id_index};
+            if (append) {
+                // Only the appended records are indexed
+                written = ingest(csv_file_names, data_file, [](const MovieRecord *, std::size_t) {});
+                extendible_hash_release_year.catch_up();
+                extendible_hash_content_type.catch_up();
+                extendible_hash_data_id.catch_up();
+            } else {
+                // The indexes are built from the records as they are written, without reading the data file back
+                ExtendibleHashIndexSet<MovieRecord> index_set{path_to_file};
+                index_set.add(extendible_hash_release_year);
+                index_set.add(extendible_hash_content_type);
+                index_set.add(extendible_hash_data_id);
+                // The builds start before the data file is complete: they are split among threads by the expected amount of records
+                index_set.create_indexes([&](auto emit) {
+                    written = ingest(csv_file_names, data_file, emit);
+                }, estimate_rows(csv_file_names));
+            }
+        }
+        data_file.sync();
+    } catch (std::exception &error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    std::cout << "Ingested " << written << " records in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms." << std::endl;
+    return 0;
+}
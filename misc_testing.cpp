@@ -17,6 +17,7 @@ struct Record {
     char code[5];
     char name[20];
     int cycle;
+    bool removed;
 
     std::string to_string() {
         std::stringstream ss;
@@ -38,7 +39,7 @@ void test_int_index() {
         return hasher(key);
     };
 
-    ExtendibleHashFile<int, Record, decltype(equal), decltype(index), decltype(hash), 3> extendibleHash{"data.dat", false, index, equal, hash};
+    ExtendibleHashFile<int, Record, 3, decltype(index), decltype(equal), decltype(hash)> extendibleHash{"data.dat", "cycle", false, index, equal, hash};
     //    Record new_record{};
     //    readFromConsole(new_record.code, 5);
     //    readFromConsole(new_record.name, 20);
@@ -64,7 +65,7 @@ void test_index_char() {
         return hasher(key);
     };
 
-    ExtendibleHashFile<char *, Record, decltype(equal), decltype(index), decltype(hash), 3> extendibleHash{"data.dat", false, index, equal, hash};
+    ExtendibleHashFile<char *, Record, 3, decltype(index), decltype(equal), decltype(hash)> extendibleHash{"data.dat", "code", false, index, equal, hash};
     //    Record new_record{};
     //    readFromConsole(new_record.code, 5);
     //    readFromConsole(new_record.name, 20);